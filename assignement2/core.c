@@ -673,6 +673,10 @@ bool sched_can_stop_tick(void)
        if (rq->nr_running > 1)
                return false;
 
+       /* Throttling dummy tasks in time needs the tick */
+       if (!dummy_can_stop_tick(rq))
+               return false;
+
        return true;
 }
 #endif /* CONFIG_NO_HZ_FULL */
@@ -764,11 +768,32 @@ static void set_load_weight(struct task_struct *p)
 	load->inv_weight = prio_to_wmult[prio];
 }
 
+/*
+ * Tasks of a class that pick_next_task() could return, as far as
+ * rq->class_mask is concerned. The stop task is always removed from the
+ * mask when it's dequeued, as there's only one.
+ */
+static inline unsigned int class_nr_running(struct rq *rq,
+					    const struct sched_class *class)
+{
+	switch (class->class_bit) {
+	case SCHED_CLASS_RT:
+		return rq->rt.rt_nr_running;
+	case SCHED_CLASS_FAIR:
+		return rq->cfs.h_nr_running;
+	case SCHED_CLASS_DUMMY:
+		return rq->dummy.nr_running;
+	default:
+		return 0;
+	}
+}
+
 static void enqueue_task(struct rq *rq, struct task_struct *p, int flags)
 {
 	update_rq_clock(rq);
 	sched_info_queued(p);
 	p->sched_class->enqueue_task(rq, p, flags);
+	rq_class_mark(rq, p->sched_class->class_bit);
 }
 
 static void dequeue_task(struct rq *rq, struct task_struct *p, int flags)
@@ -776,6 +801,8 @@ static void dequeue_task(struct rq *rq, struct task_struct *p, int flags)
 	update_rq_clock(rq);
 	sched_info_dequeued(p);
 	p->sched_class->dequeue_task(rq, p, flags);
+	if (!class_nr_running(rq, p->sched_class))
+		rq->class_mask &= ~(1U << p->sched_class->class_bit);
 }
 
 void activate_task(struct rq *rq, struct task_struct *p, int flags)
@@ -1329,6 +1356,25 @@ static void ttwu_activate(struct rq *rq, struct task_struct *p, int en_flags)
 		wq_worker_waking_up(p, cpu_of(rq));
 }
 
+#ifdef CONFIG_SMP
+/*
+ * A wakeup ends the idle period of the rq, account it in avg_idle.
+ */
+static void ttwu_update_avg_idle(struct rq *rq)
+{
+	if (rq->idle_stamp) {
+		u64 delta = rq_clock(rq) - rq->idle_stamp;
+		u64 max = 2*sysctl_sched_migration_cost;
+
+		if (delta > max)
+			rq->avg_idle = max;
+		else
+			update_avg(&rq->avg_idle, delta);
+		rq->idle_stamp = 0;
+	}
+}
+#endif
+
 /*
  * Mark the task runnable and perform wakeup-preemption.
  */
@@ -1343,16 +1389,7 @@ ttwu_do_wakeup(struct rq *rq, struct task_struct *p, int wake_flags)
 	if (p->sched_class->task_woken)
 		p->sched_class->task_woken(rq, p);
 
-	if (rq->idle_stamp) {
-		u64 delta = rq_clock(rq) - rq->idle_stamp;
-		u64 max = 2*sysctl_sched_migration_cost;
-
-		if (delta > max)
-			rq->avg_idle = max;
-		else
-			update_avg(&rq->avg_idle, delta);
-		rq->idle_stamp = 0;
-	}
+	ttwu_update_avg_idle(rq);
 #endif
 }
 
@@ -1365,6 +1402,7 @@ ttwu_do_activate(struct rq *rq, struct task_struct *p, int wake_flags)
 #endif
 
 	ttwu_activate(rq, p, ENQUEUE_WAKEUP | ENQUEUE_WAKING);
+	sched_lat_woken(rq, p);
 	ttwu_do_wakeup(rq, p, wake_flags);
 }
 
@@ -1392,20 +1430,88 @@ static int ttwu_remote(struct task_struct *p, int wake_flags)
 }
 
 #ifdef CONFIG_SMP
+/*
+ * ttwu_do_activate() for a list of woken tasks of a class that has an
+ * enqueue_task_list() method. The whole list is enqueued by a single call
+ * and wakeup-preemption is only checked once, against the task the class
+ * would run first.
+ */
+static void ttwu_do_activate_list(struct rq *rq,
+				  const struct sched_class *class,
+				  struct llist_node *list)
+{
+	struct llist_node *node, *next;
+	struct task_struct *p, *first;
+
+	update_rq_clock(rq);
+	for (node = list; node; node = node->next) {
+		p = llist_entry(node, struct task_struct, wake_entry);
+		if (p->sched_contributes_to_load)
+			rq->nr_uninterruptible--;
+		sched_info_queued(p);
+	}
+
+	first = class->enqueue_task_list(rq, list,
+					 ENQUEUE_WAKEUP | ENQUEUE_WAKING);
+	rq_class_mark(rq, class->class_bit);
+
+	for (node = list; node; node = next) {
+		next = node->next;
+		p = llist_entry(node, struct task_struct, wake_entry);
+		p->on_rq = 1;
+		sched_lat_woken(rq, p);
+
+		/* if a worker is waking up, notify workqueue */
+		if (p->flags & PF_WQ_WORKER)
+			wq_worker_waking_up(p, cpu_of(rq));
+
+		trace_sched_wakeup(p, true);
+		p->state = TASK_RUNNING;
+		if (class->task_woken)
+			class->task_woken(rq, p);
+	}
+
+	check_preempt_curr(rq, first, 0);
+	ttwu_update_avg_idle(rq);
+}
+
 static void sched_ttwu_pending(void)
 {
 	struct rq *rq = this_rq();
 	struct llist_node *llist = llist_del_all(&rq->wake_list);
+	struct llist_node *lists[NR_SCHED_CLASSES] = { NULL };
+	const struct sched_class *class;
 	struct task_struct *p;
+	int i;
 
 	raw_spin_lock(&rq->lock);
 
 	while (llist) {
 		p = llist_entry(llist, struct task_struct, wake_entry);
 		llist = llist_next(llist);
+
+		/*
+		 * Tasks of classes that can take them all at once are set
+		 * aside. Pushing them back in front of the list undoes the
+		 * reversal of llist_del_all(), so they keep their wakeup order.
+		 */
+		if (p->sched_class->enqueue_task_list) {
+			i = p->sched_class->class_bit;
+			p->wake_entry.next = lists[i];
+			lists[i] = &p->wake_entry;
+			continue;
+		}
 		ttwu_do_activate(rq, p, 0);
 	}
 
+	for (i = 0; i < NR_SCHED_CLASSES; i++) {
+		if (!lists[i])
+			continue;
+		class = llist_entry(lists[i], struct task_struct,
+				    wake_entry)->sched_class;
+		ttwu_do_activate_list(rq, class, lists[i]);
+	}
+
 	raw_spin_unlock(&rq->lock);
 }
 
@@ -1571,8 +1677,10 @@ static void try_to_wake_up_local(struct task_struct *p)
 	if (!(p->state & TASK_NORMAL))
 		goto out;
 
-	if (!p->on_rq)
+	if (!p->on_rq) {
 		ttwu_activate(rq, p, ENQUEUE_WAKEUP);
+		sched_lat_woken(rq, p);
+	}
 
 	ttwu_do_wakeup(rq, p, 0);
 	ttwu_stat(p, smp_processor_id(), 0);
@@ -1628,6 +1736,10 @@ static void __sched_fork(struct task_struct *p)
 
 	INIT_LIST_HEAD(&p->rt.run_list);
 
+	p->dummy_se.sleep_start		= 0;
+	p->dummy_se.sleep_avg		= 0;
+	p->dummy_se.boost		= 0;
+
 #ifdef CONFIG_PREEMPT_NOTIFIERS
 	INIT_HLIST_HEAD(&p->preempt_notifiers);
 #endif
@@ -2329,28 +2441,36 @@ static void put_prev_task(struct rq *rq, struct task_struct *prev)
 /*
  * Pick up the highest-prio task:
  */
+static const struct sched_class *const sched_class_of_bit[NR_SCHED_CLASSES] = {
+	[SCHED_CLASS_STOP]	= &stop_sched_class,
+	[SCHED_CLASS_RT]	= &rt_sched_class,
+	[SCHED_CLASS_FAIR]	= &fair_sched_class,
+	[SCHED_CLASS_DUMMY]	= &dummy_sched_class,
+	[SCHED_CLASS_IDLE]	= &idle_sched_class,
+};
+
 static inline struct task_struct *
 pick_next_task(struct rq *rq)
 {
-	const struct sched_class *class;
+	unsigned int mask = rq->class_mask;
 	struct task_struct *p;
 
 	/*
-	 * Optimization: we know that if all tasks are in
-	 * the fair class we can call that function directly:
+	 * Optimization: only the classes that have tasks are asked, in
+	 * order. Usually that's a single class, which is then called
+	 * directly instead of walking the whole list of classes.
 	 */
-//	if (likely(rq->nr_running == rq->cfs.h_nr_running)) {
-//		p = fair_sched_class.pick_next_task(rq);
-//		if (likely(p))
-//			return p;
-//	}
-
-	for_each_class(class) {
-		p = class->pick_next_task(rq);
-		if (p)
+	while (mask) {
+		p = sched_class_of_bit[__ffs(mask)]->pick_next_task(rq);
+		if (likely(p))
 			return p;
+		mask &= mask - 1;
 	}
 
+	p = idle_sched_class.pick_next_task(rq);
+	if (likely(p))
+		return p;
+
 	BUG(); /* the idle class will always have a runnable task */
 }
 
@@ -4997,6 +5117,7 @@ static void free_rootdomain(struct rcu_head *rcu)
 	struct root_domain *rd = container_of(rcu, struct root_domain, rcu);
 
 	cpupri_cleanup(&rd->cpupri);
+	free_cpumask_var(rd->dummy_overload_mask);
 	free_cpumask_var(rd->rto_mask);
 	free_cpumask_var(rd->online);
 	free_cpumask_var(rd->span);
@@ -5050,11 +5171,15 @@ static int init_rootdomain(struct root_domain *rd)
 		goto free_span;
 	if (!alloc_cpumask_var(&rd->rto_mask, GFP_KERNEL))
 		goto free_online;
+	if (!alloc_cpumask_var(&rd->dummy_overload_mask, GFP_KERNEL))
+		goto free_rto_mask;
 
 	if (cpupri_init(&rd->cpupri) != 0)
-		goto free_rto_mask;
+		goto free_dummy_overload_mask;
 	return 0;
 
+free_dummy_overload_mask:
+	free_cpumask_var(rd->dummy_overload_mask);
 free_rto_mask:
 	free_cpumask_var(rd->rto_mask);
 free_online:
@@ -6417,6 +6542,9 @@ void __init sched_init(void)
 #ifdef CONFIG_RT_GROUP_SCHED
 	alloc_size += 2 * nr_cpu_ids * sizeof(void **);
 #endif
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+	alloc_size += 2 * nr_cpu_ids * sizeof(void **);
+#endif
 #ifdef CONFIG_CPUMASK_OFFSTACK
 	alloc_size += num_possible_cpus() * cpumask_size();
 #endif
@@ -6439,6 +6567,14 @@ void __init sched_init(void)
 		ptr += nr_cpu_ids * sizeof(void **);
 
 #endif /* CONFIG_RT_GROUP_SCHED */
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+		root_task_group.dummy_se = (struct sched_dummy_entity **)ptr;
+		ptr += nr_cpu_ids * sizeof(void **);
+
+		root_task_group.dummy_rq = (struct dummy_rq **)ptr;
+		ptr += nr_cpu_ids * sizeof(void **);
+
+#endif /* CONFIG_DUMMY_GROUP_SCHED */
 #ifdef CONFIG_CPUMASK_OFFSTACK
 		for_each_possible_cpu(i) {
 			per_cpu(load_balance_mask, i) = (void *)ptr;
@@ -6509,6 +6645,9 @@ void __init sched_init(void)
 		INIT_LIST_HEAD(&rq->leaf_rt_rq_list);
 		init_tg_rt_entry(&root_task_group, &rq->rt, NULL, i, NULL);
 #endif
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+		init_tg_dummy_entry(&root_task_group, &rq->dummy, NULL, i, NULL);
+#endif
 
 		for (j = 0; j < CPU_LOAD_IDX_MAX; j++)
 			rq->cpu_load[j] = 0;
@@ -6745,6 +6884,7 @@ static void free_sched_group(struct task_group *tg)
 {
 	free_fair_sched_group(tg);
 	free_rt_sched_group(tg);
+	free_dummy_sched_group(tg);
 	autogroup_free(tg);
 	kfree(tg);
 }
@@ -6764,6 +6904,9 @@ struct task_group *sched_create_group(struct task_group *parent)
 	if (!alloc_rt_sched_group(tg, parent))
 		goto err;
 
+	if (!alloc_dummy_sched_group(tg, parent))
+		goto err;
+
 	return tg;
 
 err:
@@ -7522,6 +7665,19 @@ static u64 cpu_rt_period_read_uint(struct cgroup *cgrp, struct cftype *cft)
 }
 #endif /* CONFIG_RT_GROUP_SCHED */
 
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+static int cpu_dummy_level_write_u64(struct cgroup *cgrp, struct cftype *cft,
+				     u64 level)
+{
+	return sched_group_set_dummy_level(cgroup_tg(cgrp), level);
+}
+
+static u64 cpu_dummy_level_read_u64(struct cgroup *cgrp, struct cftype *cft)
+{
+	return cgroup_tg(cgrp)->dummy_level;
+}
+#endif /* CONFIG_DUMMY_GROUP_SCHED */
+
 static struct cftype cpu_files[] = {
 #ifdef CONFIG_FAIR_GROUP_SCHED
 	{
@@ -7557,6 +7713,13 @@ static struct cftype cpu_files[] = {
 		.read_u64 = cpu_rt_period_read_uint,
 		.write_u64 = cpu_rt_period_write_uint,
 	},
+#endif
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+	{
+		.name = "dummy_level",
+		.read_u64 = cpu_dummy_level_read_u64,
+		.write_u64 = cpu_dummy_level_write_u64,
+	},
 #endif
 	{ }	/* terminate */
 };
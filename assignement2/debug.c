@@ -561,6 +561,34 @@ void proc_sched_show_task(struct task_struct *p, struct seq_file *m)
 		__PN(avg_atom);
 		__PN(avg_per_cpu);
 	}
+
+	{
+		unsigned int class = p->sched_class->class_bit;
+		unsigned long count[SCHED_LAT_BUCKETS];
+		int type, cpu, i;
+
+		/*
+		 * Latency histograms of the class of p, summed over the cpus.
+		 * Bucket i counts latencies of [2^(i-1), 2^i) ns.
+		 */
+		SEQ_printf(m, "%-45s:%21s\n",
+			   "lat_hist.class", sched_class_names[class]);
+		for (type = 0; type < NR_SCHED_LAT; type++) {
+			memset(count, 0, sizeof(count));
+			for_each_possible_cpu(cpu) {
+				struct sched_lat_hist *hist =
+					&cpu_rq(cpu)->lat_hist[type][class];
+
+				for (i = 0; i < SCHED_LAT_BUCKETS; i++)
+					count[i] += hist->count[i];
+			}
+
+			SEQ_printf(m, "lat_hist.%-36s:", sched_lat_names[type]);
+			for (i = 0; i < SCHED_LAT_BUCKETS; i++)
+				SEQ_printf(m, " %lu", count[i]);
+			SEQ_printf(m, "\n");
+		}
+	}
 #endif
 	__P(nr_switches);
 	SEQ_printf(m, "%-45s:%21Ld\n",
@@ -4,24 +4,45 @@
 
 #include "sched.h"
 
+#include <linux/slab.h>
+
 /*
  * Timeslice and age threshold are represented in jiffies. Default timeslice
- * is 100ms. Both parameters can be tuned from /proc/sys/kernel.
+ * is 100ms, scaled for each level by sysctl_sched_dummy_timeslice_scale.
+ * All of them can be tuned from /proc/sys/kernel.
  */
 
 #define DUMMY_TIMESLICE		(100 * HZ / 1000)
 #define DUMMY_AGE_THRESHOLD	(3 * DUMMY_TIMESLICE)
 
+/*
+ * Interactivity boost. The time a task sleeps is credited to its sleep_avg
+ * (in ns, bounded by DUMMY_MAX_SLEEP_AVG) and spent again tick by tick while
+ * it runs. Every DUMMY_BOOST_STEP of credit lifts the task by one level when
+ * it wakes up, at most DUMMY_MAX_BOOST levels above where it was.
+ */
+#define DUMMY_BOOST_STEP	(50 * NSEC_PER_MSEC)
+#define DUMMY_MAX_BOOST		2
+#define DUMMY_MAX_SLEEP_AVG	(DUMMY_MAX_BOOST * DUMMY_BOOST_STEP)
+
+#define DUMMY_PRIO_LOWER_BOUND	(DUMMY_PRIO_UPPER_BOUND - NBR_DUMMY_PRIO + 1)
+
 
 
 
 unsigned int sysctl_sched_dummy_timeslice = DUMMY_TIMESLICE;
 
+#define DUMMY_MAX_TIMESLICE_SCALE	1000
 
-static inline unsigned int get_timeslice()
-{
-	return sysctl_sched_dummy_timeslice;
-}
+/*
+ * Timeslice of each level, in percent of sysctl_sched_dummy_timeslice. The
+ * top levels get short slices to stay responsive, the bottom ones long slices
+ * so that batch work switches less often. Values are clamped to
+ * [1, DUMMY_MAX_TIMESLICE_SCALE].
+ */
+unsigned int sysctl_sched_dummy_timeslice_scale[NBR_DUMMY_PRIO] = {
+	25, 50, 100, 200, 400
+};
 
 unsigned int sysctl_sched_dummy_age_threshold = DUMMY_AGE_THRESHOLD;
 static inline unsigned int get_age_threshold()
@@ -29,6 +50,29 @@ static inline unsigned int get_age_threshold()
 	return sysctl_sched_dummy_age_threshold;
 }
 
+/*
+ * Bandwidth of the dummy tasks of each rq, in us. A negative runtime, the
+ * default, doesn't limit them.
+ */
+unsigned int sysctl_sched_dummy_period = 1000000;
+int sysctl_sched_dummy_runtime = -1;
+
+static inline ktime_t dummy_period(void)
+{
+	return ns_to_ktime((u64)sysctl_sched_dummy_period * NSEC_PER_USEC);
+}
+
+static inline u64 dummy_runtime(void)
+{
+	if (sysctl_sched_dummy_runtime < 0 ||
+	    (unsigned int)sysctl_sched_dummy_runtime >= sysctl_sched_dummy_period)
+		return RUNTIME_INF;
+
+	return (u64)sysctl_sched_dummy_runtime * NSEC_PER_USEC;
+}
+
+static enum hrtimer_restart sched_dummy_period_timer(struct hrtimer *timer);
+
 /*
  * Init
  */
@@ -42,6 +86,128 @@ void init_dummy_rq(struct dummy_rq *dummy_rq, struct rq *rq)
 	for (i = 0; i < NBR_DUMMY_PRIO; i++) {
 		INIT_LIST_HEAD(array->queues + i);
 	}
+	dummy_rq->nr_running = 0;
+
+	dummy_rq->throttled = 0;
+	dummy_rq->time = 0;
+#ifdef CONFIG_SMP
+	dummy_rq->overloaded = 0;
+#endif
+	hrtimer_init(&dummy_rq->period_timer,
+			CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dummy_rq->period_timer.function = sched_dummy_period_timer;
+}
+
+/*
+ * Bandwidth control
+ *
+ * Throttling doesn't touch the queues: the dummy tasks stay queued, the class
+ * bit of the rq is cleared and pick_next_task_dummy() returns nothing until
+ * the period timer gives the budget back. As with CFS throttling, the dummy
+ * tasks are taken out of rq->nr_running meanwhile, so that the cpu still
+ * looks idle to the load balancer. Both ways are O(1) whatever the number of
+ * dummy tasks.
+ */
+
+static void throttle_dummy_rq(struct rq *rq)
+{
+	rq->dummy.throttled = 1;
+	rq->nr_running -= rq->dummy.nr_running;
+	rq->class_mask &= ~(1U << SCHED_CLASS_DUMMY);
+	resched_task(rq->curr);
+}
+
+static void unthrottle_dummy_rq(struct rq *rq)
+{
+	rq->dummy.throttled = 0;
+	rq->nr_running += rq->dummy.nr_running;
+	if (rq->dummy.nr_running) {
+		rq_class_mark(rq, SCHED_CLASS_DUMMY);
+		resched_task(rq->curr);
+	}
+}
+
+static int do_sched_dummy_period_timer(struct rq *rq, int overrun)
+{
+	struct dummy_rq *dummy_rq = &rq->dummy;
+	u64 runtime = dummy_runtime();
+	int idle;
+
+	raw_spin_lock(&rq->lock);
+	if (runtime == RUNTIME_INF)
+		dummy_rq->time = 0;
+	else
+		dummy_rq->time -= min(dummy_rq->time, overrun * runtime);
+
+	if (dummy_rq->throttled && dummy_rq->time < runtime)
+		unthrottle_dummy_rq(rq);
+
+	/* Without a limit, update_curr_dummy() doesn't need the timer anymore */
+	idle = runtime == RUNTIME_INF ||
+		(!dummy_rq->time && !dummy_rq->nr_running);
+	raw_spin_unlock(&rq->lock);
+
+	return idle;
+}
+
+static enum hrtimer_restart sched_dummy_period_timer(struct hrtimer *timer)
+{
+	struct dummy_rq *dummy_rq =
+		container_of(timer, struct dummy_rq, period_timer);
+	struct rq *rq = container_of(dummy_rq, struct rq, dummy);
+	ktime_t now;
+	int overrun;
+	int idle = 0;
+
+	for (;;) {
+		now = hrtimer_cb_get_time(timer);
+		overrun = hrtimer_forward(timer, now, dummy_period());
+
+		if (!overrun)
+			break;
+
+		idle = do_sched_dummy_period_timer(rq, overrun);
+	}
+
+	return idle ? HRTIMER_NORESTART : HRTIMER_RESTART;
+}
+
+/*
+ * Charge the time the current task ran since it was last accounted, and
+ * throttle the rq once it went over its budget.
+ */
+static void update_curr_dummy(struct rq *rq)
+{
+	struct task_struct *curr = rq->curr;
+	struct dummy_rq *dummy_rq = &rq->dummy;
+	u64 delta_exec, runtime;
+
+	if (curr->sched_class != &dummy_sched_class)
+		return;
+
+	delta_exec = rq_clock_task(rq) - curr->se.exec_start;
+	if (unlikely((s64)delta_exec <= 0))
+		return;
+
+	schedstat_set(curr->se.statistics.exec_max,
+		      max(curr->se.statistics.exec_max, delta_exec));
+
+	curr->se.sum_exec_runtime += delta_exec;
+	account_group_exec_runtime(curr, delta_exec);
+
+	curr->se.exec_start = rq_clock_task(rq);
+	cpuacct_charge(curr, delta_exec);
+
+	runtime = dummy_runtime();
+	if (runtime == RUNTIME_INF)
+		return;
+
+	if (!hrtimer_active(&dummy_rq->period_timer))
+		start_bandwidth_timer(&dummy_rq->period_timer, dummy_period());
+
+	dummy_rq->time += delta_exec;
+	if (!dummy_rq->throttled && dummy_rq->time > runtime)
+		throttle_dummy_rq(rq);
 }
 
 /*
@@ -57,18 +223,452 @@ static inline struct task_struct *dummy_task_of(struct sched_dummy_entity *dummy
 	return container_of(dummy_se, struct task_struct, dummy_se);
 }
 
-static inline void _enqueue_task_dummy(struct rq *rq, struct task_struct *p)
+/* Timeslice of p at its current level, at least one tick */
+static inline unsigned int get_timeslice(struct task_struct *p)
+{
+	unsigned int scale = sysctl_sched_dummy_timeslice_scale[get_list_prio(p)];
+	u64 slice;
+
+	scale = clamp_t(unsigned int, scale, 1, DUMMY_MAX_TIMESLICE_SCALE);
+	slice = div_u64((u64)sysctl_sched_dummy_timeslice * scale, 100);
+
+	return clamp_t(u64, slice, 1, UINT_MAX);
+}
+
+/*
+ * Group scheduling
+ *
+ * Each group has a dummy_rq per cpu, queued as an entity in the dummy_rq of
+ * its parent at the level set for the group (cpu.dummy_level) as long as it
+ * has runnable tasks. Picking walks down from rq->dummy to a task.
+ */
+
+static inline int dummy_rq_empty(struct dummy_rq *dummy_rq)
+{
+	int i;
+
+	for (i = 0; i < NBR_DUMMY_PRIO; i++) {
+		if (!list_empty(dummy_rq->array.queues + i))
+			return 0;
+	}
+	return 1;
+}
+
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+
+#define DUMMY_GROUP_LEVEL	(NBR_DUMMY_PRIO / 2)
+
+static DEFINE_MUTEX(dummy_level_mutex);
+
+static inline struct dummy_rq *group_dummy_rq(struct sched_dummy_entity *dummy_se)
+{
+	return dummy_se->my_q;
+}
+
+static inline struct dummy_rq *task_dummy_rq(struct rq *rq, struct task_struct *p)
+{
+	return p->dummy_se.dummy_rq;
+}
+
+static inline int dummy_se_level(struct sched_dummy_entity *dummy_se)
+{
+	if (dummy_se->my_q)
+		return dummy_se->my_q->tg->dummy_level;
+	return get_list_prio(dummy_task_of(dummy_se));
+}
+
+static inline struct list_head *dummy_se_queue(struct sched_dummy_entity *dummy_se)
+{
+	return dummy_se->dummy_rq->array.queues + dummy_se_level(dummy_se);
+}
+
+/* The groups of a task become runnable with their first task */
+static void enqueue_dummy_groups(struct sched_dummy_entity *dummy_se)
+{
+	for (dummy_se = dummy_se->parent; dummy_se; dummy_se = dummy_se->parent) {
+		if (!list_empty(&dummy_se->run_list))
+			break;
+		list_add_tail(&dummy_se->run_list, dummy_se_queue(dummy_se));
+	}
+}
+
+static void dequeue_dummy_groups(struct sched_dummy_entity *dummy_se)
+{
+	for (dummy_se = dummy_se->parent; dummy_se; dummy_se = dummy_se->parent) {
+		if (!dummy_rq_empty(dummy_se->my_q))
+			break;
+		list_del_init(&dummy_se->run_list);
+	}
+}
+
+/* Round robin between the groups of the same level as well */
+static void requeue_dummy_groups(struct sched_dummy_entity *dummy_se, int head)
+{
+	for (dummy_se = dummy_se->parent; dummy_se; dummy_se = dummy_se->parent) {
+		if (head)
+			list_move(&dummy_se->run_list, dummy_se_queue(dummy_se));
+		else
+			list_move_tail(&dummy_se->run_list, dummy_se_queue(dummy_se));
+	}
+}
+
+/*
+ * Move se and pse up to their ancestors that are queued on the same
+ * dummy_rq, so that their levels can be compared.
+ */
+static void
+find_matching_dummy_se(struct sched_dummy_entity **se,
+		       struct sched_dummy_entity **pse)
+{
+	struct sched_dummy_entity *a, *b;
+
+	for (b = *pse; b; b = b->parent) {
+		for (a = *se; a; a = a->parent) {
+			if (a->dummy_rq == b->dummy_rq) {
+				*se = a;
+				*pse = b;
+				return;
+			}
+		}
+	}
+}
+
+void free_dummy_sched_group(struct task_group *tg)
+{
+	int i;
+
+	for_each_possible_cpu(i) {
+		if (tg->dummy_rq)
+			kfree(tg->dummy_rq[i]);
+		if (tg->dummy_se)
+			kfree(tg->dummy_se[i]);
+	}
+
+	kfree(tg->dummy_rq);
+	kfree(tg->dummy_se);
+}
+
+void init_tg_dummy_entry(struct task_group *tg, struct dummy_rq *dummy_rq,
+		struct sched_dummy_entity *dummy_se, int cpu,
+		struct sched_dummy_entity *parent)
+{
+	struct rq *rq = cpu_rq(cpu);
+
+	dummy_rq->rq = rq;
+	dummy_rq->tg = tg;
+
+	tg->dummy_rq[cpu] = dummy_rq;
+	tg->dummy_se[cpu] = dummy_se;
+
+	if (!dummy_se)
+		return;
+
+	if (!parent)
+		dummy_se->dummy_rq = &rq->dummy;
+	else
+		dummy_se->dummy_rq = parent->my_q;
+
+	dummy_se->my_q = dummy_rq;
+	dummy_se->parent = parent;
+	INIT_LIST_HEAD(&dummy_se->run_list);
+}
+
+int alloc_dummy_sched_group(struct task_group *tg, struct task_group *parent)
+{
+	struct dummy_rq *dummy_rq;
+	struct sched_dummy_entity *dummy_se;
+	int i;
+
+	tg->dummy_rq = kzalloc(sizeof(dummy_rq) * nr_cpu_ids, GFP_KERNEL);
+	if (!tg->dummy_rq)
+		goto err;
+	tg->dummy_se = kzalloc(sizeof(dummy_se) * nr_cpu_ids, GFP_KERNEL);
+	if (!tg->dummy_se)
+		goto err;
+
+	tg->dummy_level = DUMMY_GROUP_LEVEL;
+
+	for_each_possible_cpu(i) {
+		dummy_rq = kzalloc_node(sizeof(struct dummy_rq),
+				     GFP_KERNEL, cpu_to_node(i));
+		if (!dummy_rq)
+			goto err;
+
+		dummy_se = kzalloc_node(sizeof(struct sched_dummy_entity),
+				     GFP_KERNEL, cpu_to_node(i));
+		if (!dummy_se)
+			goto err_free_rq;
+
+		init_dummy_rq(dummy_rq, cpu_rq(i));
+		init_tg_dummy_entry(tg, dummy_rq, dummy_se, i, parent->dummy_se[i]);
+	}
+
+	return 1;
+
+err_free_rq:
+	kfree(dummy_rq);
+err:
+	return 0;
+}
+
+/*
+ * Move the queued entities of tg to their new level on every cpu
+ */
+int sched_group_set_dummy_level(struct task_group *tg, u64 level)
+{
+	int i;
+
+	if (tg == &root_task_group || level >= NBR_DUMMY_PRIO)
+		return -EINVAL;
+
+	mutex_lock(&dummy_level_mutex);
+	tg->dummy_level = level;
+	for_each_possible_cpu(i) {
+		struct sched_dummy_entity *dummy_se = tg->dummy_se[i];
+		struct rq *rq = cpu_rq(i);
+		unsigned long flags;
+
+		raw_spin_lock_irqsave(&rq->lock, flags);
+		if (!list_empty(&dummy_se->run_list)) {
+			list_move_tail(&dummy_se->run_list, dummy_se_queue(dummy_se));
+			resched_task(rq->curr);
+		}
+		raw_spin_unlock_irqrestore(&rq->lock, flags);
+	}
+	mutex_unlock(&dummy_level_mutex);
+
+	return 0;
+}
+
+#else /* CONFIG_DUMMY_GROUP_SCHED */
+
+static inline struct dummy_rq *group_dummy_rq(struct sched_dummy_entity *dummy_se)
+{
+	return NULL;
+}
+
+static inline struct dummy_rq *task_dummy_rq(struct rq *rq, struct task_struct *p)
+{
+	return &rq->dummy;
+}
+
+static inline int dummy_se_level(struct sched_dummy_entity *dummy_se)
+{
+	return get_list_prio(dummy_task_of(dummy_se));
+}
+
+static inline void enqueue_dummy_groups(struct sched_dummy_entity *dummy_se) { }
+static inline void dequeue_dummy_groups(struct sched_dummy_entity *dummy_se) { }
+static inline void requeue_dummy_groups(struct sched_dummy_entity *dummy_se,
+					int head) { }
+
+static inline void
+find_matching_dummy_se(struct sched_dummy_entity **se,
+		       struct sched_dummy_entity **pse)
+{
+}
+
+void free_dummy_sched_group(struct task_group *tg) { }
+
+int alloc_dummy_sched_group(struct task_group *tg, struct task_group *parent)
+{
+	return 1;
+}
+#endif /* CONFIG_DUMMY_GROUP_SCHED */
+
+static inline void _enqueue_task_dummy(struct rq *rq, struct task_struct *p,
+				       int flags)
 {
 	struct sched_dummy_entity *dummy_se = &p->dummy_se;
-	struct dummy_prio_array *array = &rq->dummy.array;
+	struct dummy_prio_array *array = &task_dummy_rq(rq, p)->array;
 	struct list_head *queue = array->queues + get_list_prio(p);
-	list_add_tail(&dummy_se->run_list, queue);
+
+	if (flags & ENQUEUE_HEAD)
+		list_add(&dummy_se->run_list, queue);
+	else
+		list_add_tail(&dummy_se->run_list, queue);
+	enqueue_dummy_groups(dummy_se);
 }
 
 static inline void _dequeue_task_dummy(struct task_struct *p, struct rq *rq)
 {	
 	struct sched_dummy_entity *dummy_se = &p->dummy_se;
 	list_del_init(&dummy_se->run_list);
+	dequeue_dummy_groups(dummy_se);
+}
+
+/*
+ * Move a queued task to the head or the tail of the queue of its current
+ * level. Unlike a dequeue and an enqueue, nothing else is touched.
+ */
+static inline void requeue_task_dummy(struct rq *rq, struct task_struct *p,
+				      int head)
+{
+	struct dummy_prio_array *array = &task_dummy_rq(rq, p)->array;
+	struct list_head *queue = array->queues + get_list_prio(p);
+
+	if (head)
+		list_move(&p->dummy_se.run_list, queue);
+	else
+		list_move_tail(&p->dummy_se.run_list, queue);
+}
+
+/*
+ * The task used up its slice: it goes back to its own level, behind the
+ * tasks and groups of that level, with a new slice. The sleep credit of the
+ * boost levels it loses is spent too, so that the next wakeup doesn't give
+ * them back.
+ */
+static void expire_slice_dummy(struct rq *rq, struct task_struct *curr)
+{
+	struct sched_dummy_entity *dummy_se = &curr->dummy_se;
+
+	dummy_se->sleep_avg -= min_t(u64, dummy_se->sleep_avg,
+				     (u64)dummy_se->boost * DUMMY_BOOST_STEP);
+	curr->prio = curr->static_prio;
+	curr->dummy_se.aging = 0;
+	curr->dummy_se.boost = 0;
+	curr->dummy_se.time_slice = 0;
+	requeue_task_dummy(rq, curr, 0);
+	requeue_dummy_groups(&curr->dummy_se, 0);
+	resched_task(curr);
+}
+
+static inline unsigned int dummy_boost_level(struct sched_dummy_entity *dummy_se)
+{
+	return min_t(u64, div_u64(dummy_se->sleep_avg, DUMMY_BOOST_STEP),
+		     DUMMY_MAX_BOOST);
+}
+
+/*
+ * Credit the time p slept and lift it by the levels it earned since it was
+ * last boosted. Returns whether p wakes up boosted.
+ */
+static int dummy_wakeup_boost(struct rq *rq, struct task_struct *p)
+{
+	struct sched_dummy_entity *dummy_se = &p->dummy_se;
+	unsigned int level;
+
+	if (dummy_se->sleep_start) {
+		s64 slept = (s64)(rq_clock(rq) - dummy_se->sleep_start);
+
+		/* The clocks of two cpus may be slightly off */
+		if (slept > 0)
+			dummy_se->sleep_avg = min_t(u64, dummy_se->sleep_avg + slept,
+						    DUMMY_MAX_SLEEP_AVG);
+		dummy_se->sleep_start = 0;
+	}
+
+	level = dummy_boost_level(dummy_se);
+	while (dummy_se->boost < level && p->prio > DUMMY_PRIO_LOWER_BOUND) {
+		p->prio--;
+		dummy_se->boost++;
+	}
+	return dummy_se->boost > 0;
+}
+
+/*
+ * Spend ticks of the sleep credit of the running task. Returns whether it
+ * lost a level of boost and has to be requeued.
+ */
+static int dummy_decay_boost(struct task_struct *curr, unsigned int ticks)
+{
+	struct sched_dummy_entity *dummy_se = &curr->dummy_se;
+	unsigned int level;
+	int lowered = 0;
+
+	dummy_se->sleep_avg -= min_t(u64, dummy_se->sleep_avg,
+				     (u64)ticks * TICK_NSEC);
+	level = dummy_boost_level(dummy_se);
+	while (dummy_se->boost > level) {
+		dummy_se->boost--;
+		if (curr->prio < curr->static_prio) {
+			curr->prio++;
+			lowered = 1;
+		}
+	}
+	return lowered;
+}
+
+#ifdef CONFIG_SMP
+/*
+ * A rq with a dummy task waiting behind the running one is flagged in the
+ * dummy_overload_mask of its root domain, so that pull_dummy_task() only
+ * looks at those rqs. Same scheme as the RT overload mask.
+ */
+static inline int dummy_overloaded(struct rq *rq)
+{
+	return atomic_read(&rq->rd->dummy_overload_count);
+}
+
+static inline void dummy_set_overload(struct rq *rq)
+{
+	if (!rq->online)
+		return;
+
+	cpumask_set_cpu(rq->cpu, rq->rd->dummy_overload_mask);
+	/* The mask has to be visible before the count, see rt_set_overload() */
+	wmb();
+	atomic_inc(&rq->rd->dummy_overload_count);
+}
+
+static inline void dummy_clear_overload(struct rq *rq)
+{
+	if (!rq->online)
+		return;
+
+	atomic_dec(&rq->rd->dummy_overload_count);
+	cpumask_clear_cpu(rq->cpu, rq->rd->dummy_overload_mask);
+}
+
+static void update_dummy_overload(struct rq *rq)
+{
+	struct dummy_rq *dummy_rq = &rq->dummy;
+
+	if (dummy_rq->nr_running > 1) {
+		if (!dummy_rq->overloaded) {
+			dummy_set_overload(rq);
+			dummy_rq->overloaded = 1;
+		}
+	} else if (dummy_rq->overloaded) {
+		dummy_clear_overload(rq);
+		dummy_rq->overloaded = 0;
+	}
+}
+
+/* Assumes rq->lock is held */
+static void rq_online_dummy(struct rq *rq)
+{
+	if (rq->dummy.overloaded)
+		dummy_set_overload(rq);
+}
+
+/* Assumes rq->lock is held */
+static void rq_offline_dummy(struct rq *rq)
+{
+	if (rq->dummy.overloaded)
+		dummy_clear_overload(rq);
+}
+#else
+static inline void update_dummy_overload(struct rq *rq)
+{
+}
+#endif /* CONFIG_SMP */
+
+static void __enqueue_task_dummy(struct rq *rq, struct task_struct *p, int flags)
+{
+	/* Boosted tasks go first in their level, ahead of the hogs */
+	if ((flags & ENQUEUE_WAKEUP) && dummy_wakeup_boost(rq, p))
+		flags |= ENQUEUE_HEAD;
+
+	_enqueue_task_dummy(rq, p, flags);
+	if (p->dummy_se.time_slice >= get_timeslice(p)) {
+		p->dummy_se.time_slice = 0;
+	}
+	rq->dummy.nr_running++;
+	if (!rq->dummy.throttled)
+		inc_nr_running(rq);
+	update_dummy_overload(rq);
 }
 
 /*
@@ -78,102 +678,423 @@ static inline void _dequeue_task_dummy(struct task_struct *p, struct rq *rq)
 static void enqueue_task_dummy(struct rq *rq, struct task_struct *p, int flags)
 {
 	printk(KERN_CRIT "enqueue: %d, priority: %d\n",p->pid,p->prio);
-	_enqueue_task_dummy(rq, p);	
-	if (p->dummy_se.time_slice >= get_timeslice()) {
-		p->dummy_se.time_slice = 0;
-	}
-	inc_nr_running(rq);
+	__enqueue_task_dummy(rq, p, flags);
 }
 
 static void dequeue_task_dummy(struct rq *rq, struct task_struct *p, int flags)
 {
 	printk(KERN_CRIT "dequeue: %d, priority: %d\n",p->pid,p->prio);
+	update_curr_dummy(rq);
 	_dequeue_task_dummy(p, rq);	
-	dec_nr_running(rq);
+	if (flags & DEQUEUE_SLEEP)
+		p->dummy_se.sleep_start = rq_clock(rq);
+	rq->dummy.nr_running--;
+	if (!rq->dummy.throttled)
+		dec_nr_running(rq);
+	update_dummy_overload(rq);
+}
+
+#ifdef CONFIG_SMP
+/*
+ * Remote wakeups are batched on the rq->wake_list of the target cpu, and
+ * sched_ttwu_pending() hands us all the dummy tasks of the batch at once.
+ * Unlike enqueue_task_dummy() there is no printk per task.
+ */
+static struct task_struct *
+enqueue_task_list_dummy(struct rq *rq, struct llist_node *list, int flags)
+{
+	struct task_struct *p, *first = NULL;
+
+	for (; list; list = list->next) {
+		p = llist_entry(list, struct task_struct, wake_entry);
+		__enqueue_task_dummy(rq, p, flags);
+
+		if (!first || get_list_prio(p) < get_list_prio(first))
+			first = p;
+	}
+	return first;
+}
+
+/*
+ * Migration cost between two cpus: sysctl_sched_migration_cost when they
+ * share a cache, twice that when they don't, scaled by the NUMA distance
+ * across nodes.
+ */
+static u64 dummy_migration_cost(int src_cpu, int dst_cpu)
+{
+	u64 cost = sysctl_sched_migration_cost;
+	int src_node, dst_node;
+
+	if (cpus_share_cache(src_cpu, dst_cpu))
+		return cost;
+
+	cost *= 2;
+	src_node = cpu_to_node(src_cpu);
+	dst_node = cpu_to_node(dst_cpu);
+	if (src_node != dst_node)
+		cost = div_u64(cost * node_distance(src_node, dst_node),
+			       LOCAL_DISTANCE);
+	return cost;
+}
+
+/*
+ * Is p still cache hot on its cpu, as far as moving it to dst_cpu goes?
+ * se.exec_start is when it last ran, see update_curr_dummy().
+ */
+static int task_hot_dummy(struct task_struct *p, u64 now, int dst_cpu)
+{
+	s64 delta;
+
+	if (sysctl_sched_migration_cost == -1)
+		return 1;
+	if (sysctl_sched_migration_cost == 0)
+		return 0;
+
+	delta = now - p->se.exec_start;
+
+	return delta < (s64)dummy_migration_cost(task_cpu(p), dst_cpu);
+}
+
+/*
+ * A task stays on its cpu when it's idle or when its cache there is still
+ * hot. Otherwise it goes to the idle cpu that is the cheapest to move to,
+ * preferably one sharing the cache. Wakeups from other cpus go through the
+ * wake_list of the target.
+ */
+static int
+select_task_rq_dummy(struct task_struct *p, int sd_flag, int flags)
+{
+	int prev_cpu = task_cpu(p);
+	int cpu, best_cpu = prev_cpu;
+	u64 now, cost, best_cost = ~0ULL;
+
+	if (p->nr_cpus_allowed == 1 || idle_cpu(prev_cpu))
+		return prev_cpu;
+
+	/* Racy without the lock of the rq, but only a hint */
+	now = rq_clock_task(cpu_rq(prev_cpu));
+
+	for_each_cpu_and(cpu, tsk_cpus_allowed(p), cpu_online_mask) {
+		if (cpu == prev_cpu || !idle_cpu(cpu))
+			continue;
+		if (task_hot_dummy(p, now, cpu))
+			continue;
+
+		cost = dummy_migration_cost(prev_cpu, cpu);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_cpu = cpu;
+			if (cpus_share_cache(prev_cpu, cpu))
+				break;
+		}
+	}
+	return best_cpu;
+}
+
+/*
+ * First task of dummy_rq (or of its groups) that can be moved to dst_cpu,
+ * from the top level down. Tasks still cache hot on src_rq are left there.
+ */
+static struct task_struct *
+pick_pullable_task_dummy(struct rq *src_rq, struct dummy_rq *dummy_rq,
+			 int dst_cpu)
+{
+	struct sched_dummy_entity *dummy;
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < NBR_DUMMY_PRIO; i++) {
+		list_for_each_entry(dummy, dummy_rq->array.queues + i, run_list) {
+			if (group_dummy_rq(dummy)) {
+				p = pick_pullable_task_dummy(src_rq,
+						group_dummy_rq(dummy), dst_cpu);
+				if (p)
+					return p;
+				continue;
+			}
+
+			p = dummy_task_of(dummy);
+			if (task_running(src_rq, p) ||
+			    !cpumask_test_cpu(dst_cpu, tsk_cpus_allowed(p)) ||
+			    task_hot_dummy(p, rq_clock_task(src_rq), dst_cpu))
+				continue;
+			return p;
+		}
+	}
+	return NULL;
 }
 
+/*
+ * this_rq is going idle: pull a waiting dummy task from the overloaded rq
+ * that is the cheapest to move from.
+ */
+static int pull_dummy_task(struct rq *this_rq)
+{
+	int this_cpu = this_rq->cpu, cpu, src_cpu = -1, ret = 0;
+	u64 cost, best_cost = ~0ULL;
+	struct task_struct *p;
+	struct rq *src_rq;
+
+	if (likely(!dummy_overloaded(this_rq)) || this_rq->dummy.throttled)
+		return 0;
+
+	/* Racy, only a hint: the chosen rq is checked locked */
+	for_each_cpu(cpu, this_rq->rd->dummy_overload_mask) {
+		if (cpu == this_cpu)
+			continue;
+
+		cost = dummy_migration_cost(cpu, this_cpu);
+		if (cost < best_cost) {
+			best_cost = cost;
+			src_cpu = cpu;
+		}
+	}
+	if (src_cpu < 0)
+		return 0;
+
+	src_rq = cpu_rq(src_cpu);
+
+	/*
+	 * We can potentially drop this_rq's lock in
+	 * double_lock_balance, and another CPU could
+	 * alter this_rq
+	 */
+	double_lock_balance(this_rq, src_rq);
+
+	/* Something else may have been queued here meanwhile */
+	if (this_rq->nr_running)
+		goto skip;
+
+	/* task_hot_dummy() compares against the clock of src_rq */
+	update_rq_clock(src_rq);
+
+	p = pick_pullable_task_dummy(src_rq, &src_rq->dummy, this_cpu);
+	if (p) {
+		WARN_ON(!p->on_rq);
+
+		deactivate_task(src_rq, p, 0);
+		set_task_cpu(p, this_cpu);
+		activate_task(this_rq, p, 0);
+		ret = 1;
+	}
+skip:
+	double_unlock_balance(this_rq, src_rq);
+
+	return ret;
+}
+
+static void pre_schedule_dummy(struct rq *rq, struct task_struct *prev)
+{
+	/* Only when nothing else is left to run here */
+	if (!rq->nr_running)
+		pull_dummy_task(rq);
+}
+#endif /* CONFIG_SMP */
+
+/*
+ * The task stays queued, it's only moved to the tail of its level (and its
+ * groups to the tail of theirs).
+ */
 static void yield_task_dummy(struct rq *rq)
 {
 	struct task_struct *p = rq->curr;
-	dequeue_task_dummy(rq, p, 0);
 	if (p->dummy_se.aging >= get_age_threshold()) {
 		p->dummy_se.aging = 0;
 		p->prio = p->static_prio;
 	}
-	enqueue_task_dummy(rq, p, 0);
+	requeue_task_dummy(rq, p, 0);
+	requeue_dummy_groups(&p->dummy_se, 0);
+}
+
+/*
+ * Directed yield: what is left of the slice of the current task goes to p,
+ * which is put first in its level so that it runs next there. Both rqs are
+ * locked by yield_to().
+ */
+static bool yield_to_task_dummy(struct rq *rq, struct task_struct *p, bool preempt)
+{
+	struct task_struct *curr = rq->curr;
+	struct rq *p_rq = task_rq(p);
+	unsigned int slice = get_timeslice(curr);
+	unsigned int left;
+
+	/* throttled rqs don't run their dummy tasks */
+	if (!p->on_rq || p_rq->dummy.throttled)
+		return false;
+
+	left = curr->dummy_se.time_slice < slice ?
+		slice - curr->dummy_se.time_slice : 0;
+	p->dummy_se.time_slice -= min_t(unsigned int, p->dummy_se.time_slice, left);
+	requeue_task_dummy(p_rq, p, 1);
+	requeue_dummy_groups(&p->dummy_se, 1);
+
+	expire_slice_dummy(rq, curr);
+
+	return true;
 }
 
 static void check_preempt_curr_dummy(struct rq *rq, struct task_struct *p, int flags)
 {
 	struct task_struct *curr = rq->curr;
-	if(get_list_prio(p) < get_list_prio(curr)) {
+	struct sched_dummy_entity *se = &curr->dummy_se, *pse = &p->dummy_se;
+
+	find_matching_dummy_se(&se, &pse);
+	if(dummy_se_level(pse) < dummy_se_level(se)) {
+		resched_task(curr);
+	} else if (dummy_se_level(pse) == dummy_se_level(se) &&
+		   !group_dummy_rq(se) && !group_dummy_rq(pse) &&
+		   p->dummy_se.boost > curr->dummy_se.boost) {
+		/* A woken interactive task doesn't wait for the slice of a hog */
 		resched_task(curr);
 	}
 }
 
-static struct task_struct *pick_next_task_dummy(struct rq *rq)
+static struct sched_dummy_entity *pick_next_dummy_entity(struct dummy_rq *dummy_rq)
 {
-	struct dummy_rq *dummy_rq = &rq->dummy;
-	struct sched_dummy_entity *next;
 	int i;
 	for(i=0; i<NBR_DUMMY_PRIO; ++i){
 		if (!list_empty(dummy_rq->array.queues + i)) {
-			next = list_first_entry(dummy_rq->array.queues + i, struct sched_dummy_entity, run_list);
-			return dummy_task_of(next);
-		} else {}
+			return list_first_entry(dummy_rq->array.queues + i, struct sched_dummy_entity, run_list);
+		}
 	}
 	return NULL;
 }
 
+#ifdef CONFIG_NO_HZ_FULL
+/*
+ * A lone dummy task doesn't need the tick: the ticks it missed are counted
+ * from the clock at the next one. Bandwidth control needs it to throttle in
+ * time though.
+ */
+bool dummy_can_stop_tick(struct rq *rq)
+{
+	return !rq->dummy.nr_running || dummy_runtime() == RUNTIME_INF;
+}
+#endif
+
+static inline void dummy_tick_start(struct rq *rq)
+{
+#ifdef CONFIG_NO_HZ_FULL
+	rq->dummy.tick_stamp = rq_clock_task(rq);
+#endif
+}
+
+/*
+ * Number of ticks the running task is charged at this one. That's one, but
+ * on a nohz_full cpu the tick may have been stopped since the last one.
+ * Only the running task is concerned: the tick runs while others wait.
+ */
+static unsigned int dummy_ticks(struct rq *rq)
+{
+#ifdef CONFIG_NO_HZ_FULL
+	struct dummy_rq *dummy_rq = &rq->dummy;
+	u64 now = rq_clock_task(rq);
+	u64 ticks;
+
+	if (tick_nohz_full_cpu(cpu_of(rq))) {
+		ticks = div_u64(now - dummy_rq->tick_stamp, TICK_NSEC);
+		if (ticks > 1) {
+			dummy_rq->tick_stamp += ticks * TICK_NSEC;
+			return min_t(u64, ticks, UINT_MAX);
+		}
+	}
+	dummy_rq->tick_stamp = now;
+#endif
+	return 1;
+}
+
+static struct task_struct *pick_next_task_dummy(struct rq *rq)
+{
+	struct dummy_rq *dummy_rq = &rq->dummy;
+	struct sched_dummy_entity *next;
+	struct task_struct *p;
+
+	if (dummy_rq->throttled)
+		return NULL;
+
+	do {
+		next = pick_next_dummy_entity(dummy_rq);
+		if (!next)
+			return NULL;
+		dummy_rq = group_dummy_rq(next);
+	} while (dummy_rq);
+
+	p = dummy_task_of(next);
+	p->se.exec_start = rq_clock_task(rq);
+	dummy_tick_start(rq);
+	return p;
+}
+
 static void put_prev_task_dummy(struct rq *rq, struct task_struct *prev)
 {
-	
+	update_curr_dummy(rq);
 }
 
 static void set_curr_task_dummy(struct rq *rq)
 {
-	//struct task_struct *p = rq->curr;
-	//p->se.exec_start = rq_clock_task(rq);
+	struct task_struct *p = rq->curr;
+	p->se.exec_start = rq_clock_task(rq);
+	dummy_tick_start(rq);
 }
 
-static void task_tick_dummy(struct rq *rq, struct task_struct *curr, int queued)
+/*
+ * Age the tasks waiting in dummy_rq and in the groups queued on it
+ */
+static void age_dummy_rq(struct rq *rq, struct dummy_rq *dummy_rq)
 {
-	/*
-	 * Requeue to the end of queue if we (and all of our ancestors) are the
-	 * only element on the queue
-	 */
 	int i;
 
-	curr->dummy_se.time_slice++;
-
-	if (curr->dummy_se.time_slice >= get_timeslice()) {
-		curr->prio = curr->static_prio;
-		curr->dummy_se.aging = 0;
-		dequeue_task_dummy(rq, curr, queued);
-		enqueue_task_dummy(rq, curr, queued);
-		resched_task(curr);
-	}
-	
-	for (i = 1; i < NBR_DUMMY_PRIO; i++) {
+	for (i = 0; i < NBR_DUMMY_PRIO; i++) {
 		/*struct list_head *temp;
 		INIT_LIST_HEAD(temp);*/
 		struct sched_dummy_entity *dummy;
 		struct sched_dummy_entity *dummy_temp;
-		list_for_each_entry_safe(dummy, dummy_temp, rq->dummy.array.queues + i, run_list) {
+		list_for_each_entry_safe(dummy, dummy_temp, dummy_rq->array.queues + i, run_list) {
+			if (group_dummy_rq(dummy)) {
+				age_dummy_rq(rq, group_dummy_rq(dummy));
+				continue;
+			}
+			if (i == 0)
+				continue;
 			dummy->aging++;
 			if(dummy->aging >= get_age_threshold() && dummy_task_of(dummy)->prio > DUMMY_PRIO_UPPER_BOUND - 5 + 1) {
 				printk(KERN_CRIT "process %d aged\n",dummy_task_of(dummy)->pid);
 				dummy->aging = 0;
 				dummy_task_of(dummy)->prio = dummy_task_of(dummy)->prio-1;
-				dequeue_task_dummy(rq, dummy_task_of(dummy), queued);
- 				enqueue_task_dummy(rq, dummy_task_of(dummy), queued);
+				requeue_task_dummy(rq, dummy_task_of(dummy), 0);
  				resched_task(dummy_task_of(dummy));
-				check_preempt_curr_dummy(rq, dummy_task_of(dummy), queued);
+				check_preempt_curr_dummy(rq, dummy_task_of(dummy), 0);
 			}
 		}
 	}
 }
 
+static void task_tick_dummy(struct rq *rq, struct task_struct *curr, int queued)
+{
+	/*
+	 * Requeue to the end of queue if we (and all of our ancestors) are the
+	 * only element on the queue
+	 */
+	unsigned int ticks = dummy_ticks(rq);
+	int lowered;
+
+	update_curr_dummy(rq);
+
+	curr->dummy_se.time_slice += ticks;
+
+	/* The ticks are charged to the sleep credit even when the slice ends */
+	lowered = dummy_decay_boost(curr, ticks);
+
+	if (curr->dummy_se.time_slice >= get_timeslice(curr)) {
+		expire_slice_dummy(rq, curr);
+	} else if (lowered) {
+		requeue_task_dummy(rq, curr, 0);
+		resched_task(curr);
+	}
+
+	age_dummy_rq(rq, &rq->dummy);
+}
+
 static void switched_from_dummy(struct rq *rq, struct task_struct *p)
 {
 	
@@ -200,7 +1121,7 @@ static void prio_changed_dummy(struct rq *rq, struct task_struct *p, int oldprio
 
 static unsigned int get_rr_interval_dummy(struct rq *rq, struct task_struct *p)
 {
-	return get_timeslice();
+	return get_timeslice(p);
 }
 
 
@@ -211,15 +1132,25 @@ static unsigned int get_rr_interval_dummy(struct rq *rq, struct task_struct *p)
 
 const struct sched_class dummy_sched_class = {
 	.next			= &idle_sched_class,
+	.class_bit		= SCHED_CLASS_DUMMY,
 	.enqueue_task		= enqueue_task_dummy,
 	.dequeue_task		= dequeue_task_dummy,
 	.yield_task		= yield_task_dummy,
+	.yield_to_task		= yield_to_task_dummy,
 
 	.check_preempt_curr 	= check_preempt_curr_dummy,
 
 	.pick_next_task		= pick_next_task_dummy,
 	.put_prev_task		= put_prev_task_dummy,
 
+#ifdef CONFIG_SMP
+	.select_task_rq		= select_task_rq_dummy,
+	.enqueue_task_list	= enqueue_task_list_dummy,
+	.pre_schedule		= pre_schedule_dummy,
+	.rq_online		= rq_online_dummy,
+	.rq_offline		= rq_offline_dummy,
+#endif
+
 	.set_curr_task		= set_curr_task_dummy,
 	.task_tick		= task_tick_dummy,
 
@@ -89,6 +89,7 @@ static unsigned int get_rr_interval_idle(struct rq *rq, struct task_struct *task
  */
 const struct sched_class idle_sched_class = {
 	/* .next is NULL */
+	.class_bit		= SCHED_CLASS_IDLE,
 	/* no enqueue/yield_task for idle tasks */
 
 	/* dequeue is not valid, we print a debug message there: */
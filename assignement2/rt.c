@@ -420,8 +420,10 @@ static void sched_rt_rq_enqueue(struct rt_rq *rt_rq)
 	rt_se = rt_rq->tg->rt_se[cpu];
 
 	if (rt_rq->rt_nr_running) {
-		if (rt_se && !on_rt_rq(rt_se))
+		if (rt_se && !on_rt_rq(rt_se)) {
 			enqueue_rt_entity(rt_se, false);
+			rq_class_mark(rq_of_rt_rq(rt_rq), SCHED_CLASS_RT);
+		}
 		if (rt_rq->highest_prio.curr < curr->prio)
 			resched_task(curr);
 	}
@@ -1966,6 +1968,7 @@ static unsigned int get_rr_interval_rt(struct rq *rq, struct task_struct *task)
 
 const struct sched_class rt_sched_class = {
 	.next			= &fair_sched_class,
+	.class_bit		= SCHED_CLASS_RT,
 	.enqueue_task		= enqueue_task_rt,
 	.dequeue_task		= dequeue_task_rt,
 	.yield_task		= yield_task_rt,
@@ -167,6 +167,14 @@ struct task_group {
 	struct rt_bandwidth rt_bandwidth;
 #endif
 
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+	struct sched_dummy_entity **dummy_se;
+	struct dummy_rq **dummy_rq;
+
+	/* level of the entities of the group in the dummy_rq of its parent */
+	unsigned int dummy_level;
+#endif
+
 	struct rcu_head rcu;
 	struct list_head list;
 
@@ -233,6 +241,13 @@ extern void init_tg_rt_entry(struct task_group *tg, struct rt_rq *rt_rq,
 		struct sched_rt_entity *rt_se, int cpu,
 		struct sched_rt_entity *parent);
 
+extern void free_dummy_sched_group(struct task_group *tg);
+extern int alloc_dummy_sched_group(struct task_group *tg, struct task_group *parent);
+extern void init_tg_dummy_entry(struct task_group *tg, struct dummy_rq *dummy_rq,
+		struct sched_dummy_entity *dummy_se, int cpu,
+		struct sched_dummy_entity *parent);
+extern int sched_group_set_dummy_level(struct task_group *tg, u64 level);
+
 extern struct task_group *sched_create_group(struct task_group *parent);
 extern void sched_online_group(struct task_group *tg,
 			       struct task_group *parent);
@@ -374,6 +389,30 @@ struct dummy_prio_array{
 struct dummy_rq {
 	struct dummy_prio_array array;
 	//struct list_head queue;
+	unsigned int nr_running;
+
+	/*
+	 * Bandwidth control: the dummy tasks of the rq may run for
+	 * sysctl_sched_dummy_runtime every sysctl_sched_dummy_period.
+	 * Protected by rq->lock.
+	 */
+	int throttled;
+	u64 time;
+	struct hrtimer period_timer;
+
+#ifdef CONFIG_NO_HZ_FULL
+	/* rq_clock_task() when the running task was last charged a tick */
+	u64 tick_stamp;
+#endif
+
+#ifdef CONFIG_SMP
+	int overloaded;
+#endif
+
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+	struct rq *rq;
+	struct task_group *tg;
+#endif
 };
 
 
@@ -401,12 +440,48 @@ struct root_domain {
 	 */
 	cpumask_var_t rto_mask;
 	struct cpupri cpupri;
+
+	/*
+	 * The "dummy overload" flag: set if a CPU has more than one
+	 * runnable dummy task, see pull_dummy_task().
+	 */
+	atomic_t dummy_overload_count;
+	cpumask_var_t dummy_overload_mask;
 };
 
 extern struct root_domain def_root_domain;
 
 #endif /* CONFIG_SMP */
 
+/*
+ * Bits of rq->class_mask, in the order classes are picked from
+ */
+#define SCHED_CLASS_STOP	0
+#define SCHED_CLASS_RT		1
+#define SCHED_CLASS_FAIR	2
+#define SCHED_CLASS_DUMMY	3
+#define SCHED_CLASS_IDLE	4
+#define NR_SCHED_CLASSES	5
+
+#ifdef CONFIG_SCHEDSTATS
+/*
+ * Latency histograms, see sched_lat_account(). Bucket i counts latencies
+ * of [2^(i-1), 2^i) ns, the last one everything above.
+ */
+enum sched_lat_type {
+	SCHED_LAT_WAKEUP,	/* from wakeup to running */
+	SCHED_LAT_WAIT,		/* runnable, waiting on the runqueue */
+	SCHED_LAT_SLICE,	/* running, until switched out */
+	NR_SCHED_LAT,
+};
+
+#define SCHED_LAT_BUCKETS	32
+
+struct sched_lat_hist {
+	unsigned long count[SCHED_LAT_BUCKETS];
+};
+#endif
+
 /*
  * This is the main, per-CPU runqueue data structure.
  *
@@ -444,6 +519,13 @@ struct rq {
 	struct rt_rq rt;
 	struct dummy_rq dummy;
 
+	/*
+	 * One bit per class (SCHED_CLASS_*) that may have runnable tasks, so
+	 * that pick_next_task() only asks those. A bit may stay set while its
+	 * class is empty, but is never clear while the class has tasks.
+	 */
+	unsigned int class_mask;
+
 #ifdef CONFIG_FAIR_GROUP_SCHED
 	/* list of leaf cfs_rq on this cpu: */
 	struct list_head leaf_cfs_rq_list;
@@ -535,6 +617,9 @@ struct rq {
 	/* try_to_wake_up() stats */
 	unsigned int ttwu_count;
 	unsigned int ttwu_local;
+
+	/* per class, only updated by this cpu */
+	struct sched_lat_hist lat_hist[NR_SCHED_LAT][NR_SCHED_CLASSES];
 #endif
 
 #ifdef CONFIG_SMP
@@ -675,7 +760,6 @@ extern int group_balance_cpu(struct sched_group *sg);
 
 #endif /* CONFIG_SMP */
 
-#include "stats.h"
 #include "auto_group.h"
 
 #ifdef CONFIG_CGROUP_SCHED
@@ -701,7 +785,8 @@ static inline struct task_group *task_group(struct task_struct *p)
 /* Change a task's cfs_rq and parent entity if it moves across CPUs/groups */
 static inline void set_task_rq(struct task_struct *p, unsigned int cpu)
 {
-#if defined(CONFIG_FAIR_GROUP_SCHED) || defined(CONFIG_RT_GROUP_SCHED)
+#if defined(CONFIG_FAIR_GROUP_SCHED) || defined(CONFIG_RT_GROUP_SCHED) || \
+	defined(CONFIG_DUMMY_GROUP_SCHED)
 	struct task_group *tg = task_group(p);
 #endif
 
@@ -714,6 +799,11 @@ static inline void set_task_rq(struct task_struct *p, unsigned int cpu)
 	p->rt.rt_rq  = tg->rt_rq[cpu];
 	p->rt.parent = tg->rt_se[cpu];
 #endif
+
+#ifdef CONFIG_DUMMY_GROUP_SCHED
+	p->dummy_se.dummy_rq = tg->dummy_rq[cpu];
+	p->dummy_se.parent   = tg->dummy_se[cpu];
+#endif
 }
 
 #else /* CONFIG_CGROUP_SCHED */
@@ -980,6 +1070,7 @@ static const u32 prio_to_wmult[40] = {
 
 struct sched_class {
 	const struct sched_class *next;
+	unsigned int class_bit;		/* SCHED_CLASS_* */
 
 	void (*enqueue_task) (struct rq *rq, struct task_struct *p, int flags);
 	void (*dequeue_task) (struct rq *rq, struct task_struct *p, int flags);
@@ -1000,6 +1091,14 @@ struct sched_class {
 	void (*task_waking) (struct task_struct *task);
 	void (*task_woken) (struct rq *this_rq, struct task_struct *task);
 
+	/*
+	 * Optional: enqueue a list of woken tasks (linked by wake_entry) in
+	 * one go. Returns the one that should be checked for preemption.
+	 */
+	struct task_struct * (*enqueue_task_list) (struct rq *rq,
+						   struct llist_node *list,
+						   int flags);
+
 	void (*set_cpus_allowed)(struct task_struct *p,
 				 const struct cpumask *newmask);
 
@@ -1024,6 +1123,15 @@ struct sched_class {
 #endif
 };
 
+/*
+ * For the paths that make tasks of a class runnable without going through
+ * enqueue_task(), e.g. when a throttled group is given runtime again.
+ */
+static inline void rq_class_mark(struct rq *rq, unsigned int class_bit)
+{
+	rq->class_mask |= 1U << class_bit;
+}
+
 #define sched_class_highest (&stop_sched_class)
 #define for_each_class(class) \
    for (class = sched_class_highest; class; class = class->next)
@@ -1324,6 +1432,9 @@ extern void print_rt_stats(struct seq_file *m, int cpu);
 extern void init_cfs_rq(struct cfs_rq *cfs_rq);
 extern void init_rt_rq(struct rt_rq *rt_rq, struct rq *rq);
 extern void init_dummy_rq(struct dummy_rq *dummy_rq, struct rq *rq);
+#ifdef CONFIG_NO_HZ_FULL
+extern bool dummy_can_stop_tick(struct rq *rq);
+#endif
 
 extern void account_cfs_bandwidth_used(int enabled, int was_enabled);
 
@@ -1384,3 +1495,6 @@ static inline u64 irq_time_read(int cpu)
 }
 #endif /* CONFIG_64BIT */
 #endif /* CONFIG_IRQ_TIME_ACCOUNTING */
+
+/* after struct sched_class, the latency histograms are kept per class */
+#include "stats.h"
@@ -10,7 +10,21 @@
  * bump this up when changing the output format or the meaning of an existing
  * format, so that tools can adapt (or abort)
  */
-#define SCHEDSTAT_VERSION 15
+#define SCHEDSTAT_VERSION 16
+
+const char * const sched_lat_names[NR_SCHED_LAT] = {
+	[SCHED_LAT_WAKEUP]	= "wakeup",
+	[SCHED_LAT_WAIT]	= "wait",
+	[SCHED_LAT_SLICE]	= "slice",
+};
+
+const char * const sched_class_names[NR_SCHED_CLASSES] = {
+	[SCHED_CLASS_STOP]	= "stop",
+	[SCHED_CLASS_RT]	= "rt",
+	[SCHED_CLASS_FAIR]	= "fair",
+	[SCHED_CLASS_DUMMY]	= "dummy",
+	[SCHED_CLASS_IDLE]	= "idle",
+};
 
 static int show_schedstat(struct seq_file *seq, void *v)
 {
@@ -26,6 +40,7 @@ static int show_schedstat(struct seq_file *seq, void *v)
 		seq_printf(seq, "timestamp %lu\n", jiffies);
 	} else {
 		struct rq *rq;
+		int type, class, i;
 #ifdef CONFIG_SMP
 		struct sched_domain *sd;
 		int dcount = 0;
@@ -44,6 +59,24 @@ static int show_schedstat(struct seq_file *seq, void *v)
 
 		seq_printf(seq, "\n");
 
+		/*
+		 * latency histograms, one line per type and class: bucket i
+		 * counts latencies of [2^(i-1), 2^i) ns
+		 */
+		for (type = 0; type < NR_SCHED_LAT; type++) {
+			for (class = 0; class < NR_SCHED_CLASSES; class++) {
+				struct sched_lat_hist *hist =
+					&rq->lat_hist[type][class];
+
+				seq_printf(seq, "lat_%s %s",
+				    sched_lat_names[type],
+				    sched_class_names[class]);
+				for (i = 0; i < SCHED_LAT_BUCKETS; i++)
+					seq_printf(seq, " %lu", hist->count[i]);
+				seq_printf(seq, "\n");
+			}
+		}
+
 #ifdef CONFIG_SMP
 		/* domain-specific stats */
 		rcu_read_lock();
@@ -29,6 +29,43 @@ rq_sched_info_dequeued(struct rq *rq, unsigned long long delta)
 	if (rq)
 		rq->rq_sched_info.run_delay += delta;
 }
+
+extern const char * const sched_lat_names[NR_SCHED_LAT];
+extern const char * const sched_class_names[NR_SCHED_CLASSES];
+
+/*
+ * Count delta in the latency histogram of type for the class of p. Only
+ * called by the cpu of rq for the tasks it switches, so no atomics.
+ */
+static inline void
+sched_lat_account(struct rq *rq, struct task_struct *p, int type, u64 delta)
+{
+	int bucket = min(fls64(delta), SCHED_LAT_BUCKETS - 1);
+
+	rq->lat_hist[type][p->sched_class->class_bit].count[bucket]++;
+}
+
+/*
+ * A woken task was enqueued, its wakeup latency runs until sched_lat_arrive()
+ */
+static inline void sched_lat_woken(struct rq *rq, struct task_struct *p)
+{
+	p->se.statistics.wakeup_start = rq_clock(rq);
+}
+
+static inline void
+sched_lat_arrive(struct rq *rq, struct task_struct *p, u64 now)
+{
+	s64 delta = now - p->se.statistics.wakeup_start;
+
+	if (!p->se.statistics.wakeup_start)
+		return;
+
+	/* the task may have been woken up on another cpu */
+	if (delta > 0)
+		sched_lat_account(rq, p, SCHED_LAT_WAKEUP, delta);
+	p->se.statistics.wakeup_start = 0;
+}
 # define schedstat_inc(rq, field)	do { (rq)->field++; } while (0)
 # define schedstat_add(rq, field, amt)	do { (rq)->field += (amt); } while (0)
 # define schedstat_set(var, val)	do { var = (val); } while (0)
@@ -42,6 +79,9 @@ rq_sched_info_dequeued(struct rq *rq, unsigned long long delta)
 static inline void
 rq_sched_info_depart(struct rq *rq, unsigned long long delta)
 {}
+# define sched_lat_account(rq, p, type, delta)	do { } while (0)
+# define sched_lat_woken(rq, p)			do { } while (0)
+# define sched_lat_arrive(rq, p, now)		do { } while (0)
 # define schedstat_inc(rq, field)	do { } while (0)
 # define schedstat_add(rq, field, amt)	do { } while (0)
 # define schedstat_set(var, val)	do { } while (0)
@@ -81,8 +121,11 @@ static void sched_info_arrive(struct task_struct *t)
 {
 	unsigned long long now = rq_clock(task_rq(t)), delta = 0;
 
-	if (t->sched_info.last_queued)
+	if (t->sched_info.last_queued) {
 		delta = now - t->sched_info.last_queued;
+		sched_lat_account(task_rq(t), t, SCHED_LAT_WAIT, delta);
+	}
+	sched_lat_arrive(task_rq(t), t, now);
 	sched_info_reset_dequeued(t);
 	t->sched_info.run_delay += delta;
 	t->sched_info.last_arrival = now;
@@ -116,6 +159,7 @@ static inline void sched_info_depart(struct task_struct *t)
 					t->sched_info.last_arrival;
 
 	rq_sched_info_depart(task_rq(t), delta);
+	sched_lat_account(task_rq(t), t, SCHED_LAT_SLICE, delta);
 
 	if (t->state == TASK_RUNNING)
 		sched_info_queued(t);
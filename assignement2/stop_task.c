@@ -104,6 +104,7 @@ get_rr_interval_stop(struct rq *rq, struct task_struct *task)
  */
 const struct sched_class stop_sched_class = {
 	.next			= &rt_sched_class,
+	.class_bit		= SCHED_CLASS_STOP,
 
 	.enqueue_task		= enqueue_task_stop,
 	.dequeue_task		= dequeue_task_stop,
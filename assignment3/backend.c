@@ -0,0 +1,77 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Block device backends, shared by the FUSE driver and the checker
+ *
+ * The format of an image is found by asking the backends in turn. The raw
+ * backend comes last since it takes any file.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+static const struct vfat_backend_ops *const backends[] = {
+	&vfat_pack_backend,
+	&vfat_raw_backend,
+};
+
+static int raw_probe(int fd) {
+	return 1;
+}
+
+static int raw_open(struct vfat_backend *be) {
+	return 0;
+}
+
+static ssize_t raw_pread(struct vfat_backend *be, void *buf, size_t len,
+		off_t off) {
+	return pread(be->fd, buf, len, off);
+}
+
+static ssize_t raw_pwritev(struct vfat_backend *be, const struct iovec *iov,
+		int iovcnt, off_t off) {
+	return pwritev(be->fd, iov, iovcnt, off);
+}
+
+static int raw_sync(struct vfat_backend *be) {
+	return fdatasync(be->fd) != 0 ? -errno : 0;
+}
+
+// Plain images, the device is the file
+const struct vfat_backend_ops vfat_raw_backend = {
+	.name = "raw",
+	.direct = 1,
+	.probe = raw_probe,
+	.open = raw_open,
+	.pread = raw_pread,
+	.pwritev = raw_pwritev,
+	.sync = raw_sync,
+};
+
+/*
+ * Pick the backend of the image opened in vol->fs. Images in a format that
+ * can't be written are served read-only.
+ * Returns 0 on success or a negative errno value.
+ */
+int vfat_backend_open(struct vfat_data *vol) {
+	size_t i;
+	int res;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+		if (!backends[i]->probe(vol->fs))
+			continue;
+
+		vol->backend.ops = backends[i];
+		vol->backend.fd = vol->fs;
+		vol->backend.priv = NULL;
+		if ((res = backends[i]->open(&vol->backend)) != 0)
+			return res;
+		if (backends[i]->pwritev == NULL)
+			vol->readonly = 1;
+		return 0;
+	}
+	return -EINVAL;
+}
@@ -0,0 +1,365 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Workloads for benchmarking a mounted vfat file system
+ *
+ * usage: vfat_bench [-t threads] [-n ops] mountpoint [workload...]
+ *
+ * The mounted image has to follow the layout created by run.sh:
+ *   /BIG/FILE<n>            large files
+ *   /DEEP/D1/D2/.../LEAF    a deep path
+ *   /MANY/                  a directory with a lot of entries
+ *
+ * Every workload prints one JSON object per line, so that results can be
+ * appended to a file and compared between runs.
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEQ_READ_SIZE (128 * 1024)
+#define RANDOM_READ_SIZE 4096
+#define MAX_BIG_FILES 64
+#define READDIR_PASSES 200 // Listings are slow, but p99 needs 100+ samples
+
+// Latencies of one workload, in nanoseconds
+struct samples {
+	uint64_t *ns;
+	size_t count, capacity;
+};
+
+struct result {
+	const char *workload;
+	uint64_t bytes;
+	uint64_t ops;
+	uint64_t elapsed_ns;
+	struct samples lat;
+};
+
+static const char *mountpoint;
+static int nthreads = 4;
+static size_t nops = 100000;
+
+static char big_files[MAX_BIG_FILES][PATH_MAX];
+static int nbig_files;
+static char deep_path[PATH_MAX];
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_sample(struct samples *s, uint64_t ns) {
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? s->capacity * 2 : 1024;
+		s->ns = realloc(s->ns, s->capacity * sizeof(*s->ns));
+		if (s->ns == NULL)
+			err(1, "realloc");
+	}
+	s->ns[s->count++] = ns;
+}
+
+static void merge_samples(struct samples *dst, const struct samples *src) {
+	size_t i;
+
+	for (i = 0; i < src->count; ++i)
+		add_sample(dst, src->ns[i]);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(struct samples *s, double p) {
+	size_t i;
+
+	if (s->count == 0)
+		return 0;
+	i = (size_t) (p * (s->count - 1));
+	return s->ns[i] / 1000.0;
+}
+
+static void print_result(struct result *r) {
+	double secs = r->elapsed_ns / 1e9;
+
+	qsort(r->lat.ns, r->lat.count, sizeof(*r->lat.ns), cmp_u64);
+	printf("{\"workload\": \"%s\", \"threads\": %d, \"ops\": %llu, "
+			"\"bytes\": %llu, \"seconds\": %.6f, \"mb_s\": %.2f, "
+			"\"ops_s\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f}\n",
+			r->workload, strcmp(r->workload, "parallel") ? 1 : nthreads,
+			(unsigned long long) r->ops, (unsigned long long) r->bytes, secs,
+			secs > 0 ? r->bytes / secs / (1024 * 1024) : 0,
+			secs > 0 ? r->ops / secs : 0, percentile_us(&r->lat, 0.50),
+			percentile_us(&r->lat, 0.99));
+	fflush(stdout);
+	free(r->lat.ns);
+}
+
+/*
+ * Read a whole file with large reads, recording the latency of every read()
+ */
+static uint64_t read_file(const char *path, char *buffer, struct samples *lat,
+		uint64_t *ops) {
+	uint64_t total = 0;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		err(1, "open(%s)", path);
+
+	for (;;) {
+		uint64_t start = now_ns();
+		ssize_t n = read(fd, buffer, SEQ_READ_SIZE);
+
+		if (n < 0)
+			err(1, "read(%s)", path);
+		add_sample(lat, now_ns() - start);
+		++*ops;
+		if (n == 0)
+			break;
+		total += n;
+	}
+
+	close(fd);
+	return total;
+}
+
+static void bench_seqread(void) {
+	struct result r = { .workload = "seqread" };
+	char *buffer = malloc(SEQ_READ_SIZE);
+	uint64_t start = now_ns();
+	int i;
+
+	for (i = 0; i < nbig_files; ++i)
+		r.bytes += read_file(big_files[i], buffer, &r.lat, &r.ops);
+	r.elapsed_ns = now_ns() - start;
+
+	free(buffer);
+	print_result(&r);
+}
+
+static void bench_randread(void) {
+	struct result r = { .workload = "randread" };
+	char buffer[RANDOM_READ_SIZE];
+	unsigned int seed = 42;
+	struct stat st;
+	uint64_t start;
+	size_t i;
+	int fd;
+
+	fd = open(big_files[0], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		err(1, "%s", big_files[0]);
+	if (st.st_size < RANDOM_READ_SIZE)
+		errx(1, "%s is too small", big_files[0]);
+
+	start = now_ns();
+	for (i = 0; i < nops; ++i) {
+		off_t blocks = st.st_size / RANDOM_READ_SIZE;
+		off_t offset = (off_t) (rand_r(&seed) % blocks) * RANDOM_READ_SIZE;
+		uint64_t t = now_ns();
+		ssize_t n = pread(fd, buffer, RANDOM_READ_SIZE, offset);
+
+		if (n < 0)
+			err(1, "pread");
+		add_sample(&r.lat, now_ns() - t);
+		r.bytes += n;
+		++r.ops;
+	}
+	r.elapsed_ns = now_ns() - start;
+
+	close(fd);
+	print_result(&r);
+}
+
+static void bench_stat(void) {
+	struct result r = { .workload = "stat" };
+	struct stat st;
+	uint64_t start = now_ns();
+	size_t i;
+
+	for (i = 0; i < nops; ++i) {
+		uint64_t t = now_ns();
+
+		if (stat(deep_path, &st) < 0)
+			err(1, "stat(%s)", deep_path);
+		add_sample(&r.lat, now_ns() - t);
+		++r.ops;
+	}
+	r.elapsed_ns = now_ns() - start;
+
+	print_result(&r);
+}
+
+/*
+ * One sample per full listing, ops are the entries
+ */
+static void bench_readdir(void) {
+	struct result r = { .workload = "readdir" };
+	char path[PATH_MAX];
+	uint64_t start;
+	int pass;
+
+	snprintf(path, sizeof(path), "%s/MANY", mountpoint);
+
+	start = now_ns();
+	for (pass = 0; pass < READDIR_PASSES; ++pass) {
+		uint64_t t = now_ns();
+		DIR *dir = opendir(path);
+		struct dirent *de;
+
+		if (dir == NULL)
+			err(1, "opendir(%s)", path);
+		while ((de = readdir(dir)) != NULL)
+			++r.ops;
+		closedir(dir);
+		add_sample(&r.lat, now_ns() - t);
+	}
+	r.elapsed_ns = now_ns() - start;
+
+	print_result(&r);
+}
+
+struct reader {
+	pthread_t thread;
+	int index;
+	uint64_t bytes, ops;
+	struct samples lat;
+};
+
+static void *reader_main(void *arg) {
+	struct reader *rd = arg;
+	char *buffer = malloc(SEQ_READ_SIZE);
+
+	rd->bytes = read_file(big_files[rd->index % nbig_files], buffer, &rd->lat,
+			&rd->ops);
+	free(buffer);
+	return NULL;
+}
+
+static void bench_parallel(void) {
+	struct result r = { .workload = "parallel" };
+	struct reader *readers = calloc(nthreads, sizeof(*readers));
+	uint64_t start = now_ns();
+	int i;
+
+	for (i = 0; i < nthreads; ++i) {
+		readers[i].index = i;
+		if (pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]))
+			errx(1, "pthread_create");
+	}
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(readers[i].thread, NULL);
+		r.bytes += readers[i].bytes;
+		r.ops += readers[i].ops;
+		merge_samples(&r.lat, &readers[i].lat);
+		free(readers[i].lat.ns);
+	}
+	r.elapsed_ns = now_ns() - start;
+
+	free(readers);
+	print_result(&r);
+}
+
+/*
+ * Find the big files and the deepest directory of the tree
+ */
+static void discover_layout(void) {
+	char path[PATH_MAX];
+	struct stat st;
+	int depth;
+
+	for (nbig_files = 0; nbig_files < MAX_BIG_FILES; ++nbig_files) {
+		snprintf(big_files[nbig_files], PATH_MAX, "%s/BIG/FILE%d", mountpoint,
+				nbig_files);
+		if (stat(big_files[nbig_files], &st) < 0)
+			break;
+	}
+	if (nbig_files == 0)
+		errx(1, "%s/BIG/FILE0 not found, was the image made by run.sh?",
+				mountpoint);
+
+	snprintf(path, sizeof(path), "%s/DEEP", mountpoint);
+	for (depth = 1;; ++depth) {
+		size_t len = strlen(path);
+
+		snprintf(path + len, sizeof(path) - len, "/D%d", depth);
+		if (stat(path, &st) < 0) {
+			path[len] = '\0';
+			break;
+		}
+	}
+	snprintf(deep_path, sizeof(deep_path), "%s/LEAF", path);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} workloads[] = {
+	{ "seqread", bench_seqread },
+	{ "randread", bench_randread },
+	{ "stat", bench_stat },
+	{ "readdir", bench_readdir },
+	{ "parallel", bench_parallel },
+};
+
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void usage(void) {
+	errx(1, "usage: vfat_bench [-t threads] [-n ops] mountpoint [workload...]");
+}
+
+int main(int argc, char **argv) {
+	size_t i;
+	int opt, arg;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			nops = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || nthreads < 1)
+		usage();
+
+	mountpoint = argv[optind++];
+	discover_layout();
+
+	if (optind == argc) {
+		for (i = 0; i < NR_WORKLOADS; ++i)
+			workloads[i].run();
+		return 0;
+	}
+
+	for (arg = optind; arg < argc; ++arg) {
+		for (i = 0; i < NR_WORKLOADS; ++i) {
+			if (strcmp(argv[arg], workloads[i].name) == 0)
+				break;
+		}
+		if (i == NR_WORKLOADS)
+			errx(1, "unknown workload %s", argv[arg]);
+		workloads[i].run();
+	}
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+#!/bin/sh
+# Benchmark the vfat binary on freshly generated FAT32 images
+#
+# usage: bench/run.sh [workload...]
+#
+# Builds an image with mkfs.vfat and fills it with mtools (no root needed),
+# mounts it with ./vfat, runs bench/vfat_bench and unmounts. Results are JSON,
+# one object per line, on stdout.
+#
+# Tunables (environment):
+#   BENCH_IMAGE_MB     size of the image (default 1024)
+#   BENCH_BIG_FILES    number of large files (default 4)
+#   BENCH_BIG_MB       size of each large file (default 64)
+#   BENCH_DEPTH        depth of the deep path (default 16)
+#   BENCH_ENTRIES      entries in the large directory (default 65000, the
+#                      FAT32 limit is 65536 entries per directory)
+#   BENCH_THREADS      readers of the parallel workload (default 4)
+#   BENCH_OPS          operations of the random read and stat workloads
+#   BENCH_KEEP_IMAGE   set to keep the image in $TMPDIR between runs
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+IMAGE_MB=${BENCH_IMAGE_MB:-1024}
+BIG_FILES=${BENCH_BIG_FILES:-4}
+BIG_MB=${BENCH_BIG_MB:-64}
+DEPTH=${BENCH_DEPTH:-16}
+ENTRIES=${BENCH_ENTRIES:-65000}
+THREADS=${BENCH_THREADS:-4}
+OPS=${BENCH_OPS:-100000}
+TMP=${TMPDIR:-/tmp}
+
+for tool in mkfs.vfat mcopy mmd; do
+	command -v $tool >/dev/null || { echo "$tool is required" >&2; exit 1; }
+done
+[ -x ./vfat ] || { echo "build vfat first" >&2; exit 1; }
+
+IMAGE=$TMP/vfat-bench-$IMAGE_MB-$BIG_FILES-$BIG_MB-$DEPTH-$ENTRIES.img
+MNT=$(mktemp -d "$TMP/vfat-bench-mnt.XXXXXX")
+TREE=
+VFAT_PID=
+
+cleanup() {
+	if mount | grep -q " $MNT "; then
+		fusermount -u "$MNT" 2>/dev/null || umount "$MNT"
+	fi
+	# Profiles of PGO builds are only written when vfat exits
+	[ -n "$VFAT_PID" ] && wait "$VFAT_PID"
+	rmdir "$MNT"
+	[ -n "$TREE" ] && rm -rf "$TREE"
+	[ -n "$BENCH_KEEP_IMAGE" ] || rm -f "$IMAGE"
+}
+# cleanup runs once, on the exit that INT and TERM trigger
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if [ ! -f "$IMAGE" ]; then
+	echo "generating $IMAGE" >&2
+	TREE=$(mktemp -d "$TMP/vfat-bench-tree.XXXXXX")
+
+	mkdir "$TREE/BIG"
+	i=0
+	while [ $i -lt "$BIG_FILES" ]; do
+		dd if=/dev/urandom of="$TREE/BIG/FILE$i" bs=1M count="$BIG_MB" 2>/dev/null
+		i=$((i + 1))
+	done
+
+	dir=$TREE/DEEP
+	i=1
+	while [ $i -le "$DEPTH" ]; do
+		dir=$dir/D$i
+		i=$((i + 1))
+	done
+	mkdir -p "$dir"
+	echo leaf > "$dir/LEAF"
+
+	mkdir "$TREE/MANY"
+	(cd "$TREE/MANY" && seq -f "F%07g" 1 "$ENTRIES" | xargs touch)
+
+	rm -f "$IMAGE"
+	truncate -s "${IMAGE_MB}M" "$IMAGE"
+	mkfs.vfat -F 32 "$IMAGE" >/dev/null
+	MTOOLS_SKIP_CHECK=1 mcopy -s -i "$IMAGE" "$TREE/BIG" "$TREE/DEEP" "$TREE/MANY" ::/
+fi
+
+./vfat -f "$IMAGE" "$MNT" >/dev/null &
+VFAT_PID=$!
+i=0
+until mount | grep -q " $MNT "; do
+	i=$((i + 1))
+	[ $i -lt 50 ] || { echo "mount failed" >&2; exit 1; }
+	sleep 0.1
+done
+
+./bench/vfat_bench -t "$THREADS" -n "$OPS" "$MNT" "$@"
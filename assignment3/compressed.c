@@ -0,0 +1,261 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Backend of compressed images (see struct vfat_pack_header)
+ *
+ * Chunks are decompressed as they're read and kept in a small LRU cache, so
+ * that the cluster by cluster reads of the driver don't decompress the same
+ * chunk over and over. Decompression happens outside of the cache lock, two
+ * threads missing the same chunk just both decompress it.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "vfat.h"
+
+#define PACK_CACHE_SLOTS 64
+#define PACK_MIN_CHUNK 4096
+#define PACK_MAX_CHUNK (4 * 1024 * 1024)
+
+struct pack_slot {
+	uint64_t chunk;
+	uint64_t last_used; // 0 when the slot is empty
+	uint8_t *data;
+};
+
+struct pack {
+	struct vfat_pack_header header;
+	uint64_t *index;
+
+	pthread_mutex_t lock; // Protects the cache
+	uint64_t clock;
+	struct pack_slot slots[PACK_CACHE_SLOTS];
+};
+
+/*
+ * pread() that retries on short reads
+ * Returns 0 on success or a negative errno value.
+ */
+static int pack_read_full(int fd, void *buf, size_t len, off_t off) {
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len, off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		buf = (uint8_t*) buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int pack_probe(int fd) {
+	char magic[sizeof(VFAT_PACK_MAGIC) - 1];
+
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+			&& memcmp(magic, VFAT_PACK_MAGIC, sizeof(magic)) == 0;
+}
+
+static int pack_open(struct vfat_backend *be) {
+	struct pack *p = calloc(1, sizeof(*p));
+	struct vfat_pack_header *h;
+	struct stat st;
+	uint64_t i;
+	int res = -EINVAL;
+
+	if (p == NULL)
+		return -ENOMEM;
+	h = &p->header;
+
+	if ((res = pack_read_full(be->fd, h, sizeof(*h), 0)) != 0
+			|| fstat(be->fd, &st) != 0)
+		goto fail;
+
+	res = -EINVAL;
+	if (h->version != VFAT_PACK_VERSION || h->chunk_size < PACK_MIN_CHUNK
+			|| h->chunk_size > PACK_MAX_CHUNK
+			|| (h->chunk_size & (h->chunk_size - 1)) != 0
+			|| h->nr_chunks != (h->device_size + h->chunk_size - 1) / h->chunk_size
+			|| h->index_offset > (uint64_t) st.st_size
+			|| (h->nr_chunks + 1) * sizeof(uint64_t)
+					> (uint64_t) st.st_size - h->index_offset)
+		goto fail;
+
+	p->index = malloc((h->nr_chunks + 1) * sizeof(uint64_t));
+	if (p->index == NULL) {
+		res = -ENOMEM;
+		goto fail;
+	}
+	if ((res = pack_read_full(be->fd, p->index,
+			(h->nr_chunks + 1) * sizeof(uint64_t), h->index_offset)) != 0)
+		goto fail;
+
+	// Chunks are stored in order, between the header and the index
+	res = -EINVAL;
+	if (p->index[0] < sizeof(*h) || p->index[h->nr_chunks] > h->index_offset)
+		goto fail;
+	for (i = 0; i < h->nr_chunks; ++i) {
+		if (p->index[i + 1] < p->index[i])
+			goto fail;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	be->priv = p;
+	return 0;
+
+fail:
+	free(p->index);
+	free(p);
+	return res;
+}
+
+static size_t pack_chunk_len(const struct pack *p, uint64_t chunk) {
+	uint64_t start = chunk * p->header.chunk_size;
+
+	if (p->header.device_size - start < p->header.chunk_size)
+		return p->header.device_size - start;
+	return p->header.chunk_size;
+}
+
+/*
+ * Decompress a chunk to out (chunk_size bytes)
+ * Returns 0 on success or a negative errno value.
+ */
+static int pack_decompress(struct vfat_backend *be, struct pack *p,
+		uint64_t chunk, uint8_t *out) {
+	size_t clen = p->index[chunk + 1] - p->index[chunk];
+	size_t len = pack_chunk_len(p, chunk);
+	uLongf out_len = len;
+	uint8_t *in;
+	int res;
+
+	if (clen == 0) {
+		memset(out, 0, len);
+		return 0;
+	}
+	if (clen == len)
+		return pack_read_full(be->fd, out, len, p->index[chunk]);
+
+	in = malloc(clen);
+	if (in == NULL)
+		return -ENOMEM;
+	res = pack_read_full(be->fd, in, clen, p->index[chunk]);
+	if (res == 0 && (uncompress(out, &out_len, in, clen) != Z_OK
+			|| out_len != len))
+		res = -EIO; // Corrupted chunk
+	free(in);
+	return res;
+}
+
+/*
+ * Copy len bytes at in_chunk of a chunk from the cache.
+ * Returns whether the chunk was cached.
+ */
+static int pack_cache_read(struct pack *p, uint64_t chunk, void *buf,
+		size_t in_chunk, size_t len) {
+	size_t i;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < PACK_CACHE_SLOTS; ++i) {
+		struct pack_slot *slot = &p->slots[i];
+
+		if (slot->last_used && slot->chunk == chunk) {
+			memcpy(buf, slot->data + in_chunk, len);
+			slot->last_used = ++p->clock;
+			pthread_mutex_unlock(&p->lock);
+			return 1;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/*
+ * Put a decompressed chunk in the cache in place of the least recently used
+ * one. The cache takes data and returns the buffer the caller has to free.
+ */
+static uint8_t *pack_cache_insert(struct pack *p, uint64_t chunk, uint8_t *data) {
+	struct pack_slot *victim = &p->slots[0];
+	uint8_t *old;
+	size_t i;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < PACK_CACHE_SLOTS; ++i) {
+		struct pack_slot *slot = &p->slots[i];
+
+		if (slot->last_used && slot->chunk == chunk) {
+			pthread_mutex_unlock(&p->lock);
+			return data; // Another thread was faster
+		}
+		if (slot->last_used < victim->last_used)
+			victim = slot;
+	}
+
+	old = victim->data;
+	victim->data = data;
+	victim->chunk = chunk;
+	victim->last_used = ++p->clock;
+	pthread_mutex_unlock(&p->lock);
+
+	return old;
+}
+
+static ssize_t pack_pread(struct vfat_backend *be, void *buf, size_t len,
+		off_t off) {
+	struct pack *p = be->priv;
+	size_t done = 0;
+
+	if (off < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((uint64_t) off >= p->header.device_size)
+		return 0;
+	if (len > p->header.device_size - off)
+		len = p->header.device_size - off;
+
+	while (done < len) {
+		uint64_t chunk = (off + done) / p->header.chunk_size;
+		size_t in_chunk = (off + done) % p->header.chunk_size;
+		size_t n = pack_chunk_len(p, chunk) - in_chunk;
+		uint8_t *data;
+		int res;
+
+		if (n > len - done)
+			n = len - done;
+
+		if (!pack_cache_read(p, chunk, (uint8_t*) buf + done, in_chunk, n)) {
+			data = malloc(p->header.chunk_size);
+			res = data ? pack_decompress(be, p, chunk, data) : -ENOMEM;
+			if (res != 0) {
+				free(data);
+				if (done > 0)
+					break;
+				errno = -res;
+				return -1;
+			}
+			memcpy((uint8_t*) buf + done, data + in_chunk, n);
+			free(pack_cache_insert(p, chunk, data));
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+// Images written by vfat_pack, read-only
+const struct vfat_backend_ops vfat_pack_backend = {
+	.name = "pack",
+	.direct = 0,
+	.probe = pack_probe,
+	.open = pack_open,
+	.pread = pack_pread,
+};
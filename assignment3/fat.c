@@ -0,0 +1,214 @@
+// vim: noet:ts=8:sts=8
+/*
+ * On-disk FAT32 parsing shared by the FUSE driver (vfat.c) and the checker (fsck.c)
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define MIN_NB_OF_SECTORS 65525
+#define MAX_CLUSTER_SIZE 32768
+
+/*
+ * Remove spaces from a filename (name + extension)
+ * The output array has to be able to contain at least 12 characters
+ */
+void trim_filename(char* output, char* nameext) {
+	if (output && nameext) {
+
+		size_t i;
+		size_t out_offset = 0;
+
+		for (i = 0; i < 11; ++i) { // Short names are always 11 characters long
+			if (nameext[i] != 0x20) { // The character is not a space
+				output[out_offset++] = nameext[i];
+			}
+		}
+
+		output[out_offset] = '\0';
+	}
+}
+
+/*
+ * Checks the Volume ID and make sure it's a FAT32 partition
+ * Be careful since this function ends the program if the boot sector is invalid
+ */
+void check_boot_validity(const struct fat_boot* data) {
+
+	switch (data->bytes_per_sector) {
+	case 512:
+	case 1024:
+	case 2048:
+	case 4096:
+		break; // Valid value
+	default:
+		errx(1, "Invalid number of bytes per sector. Exiting...");
+	}
+
+	switch (data->sectors_per_cluster) {
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+	case 16:
+	case 32:
+	case 64:
+	case 128:
+		break; // Valid value
+	default:
+		errx(1, "Invalid number of sectors per cluster. Exiting...");
+	}
+
+	if (data->sectors_per_cluster * data->bytes_per_sector >= MAX_CLUSTER_SIZE) {
+		errx(1, "Invalid cluster size. Exiting...");
+	}
+
+	// Checking various fields of the boot sector
+	if (data->fat_count != 2 || data->root_max_entries != 0
+			|| data->total_sectors_small != 0
+			|| data->sectors_per_fat_small != 0 || data->fat32.version != 0
+			|| data->fat32.signature != 0xAA55) {
+		errx(1, "Invalid FAT32 boot sector. Exiting...");
+	}
+
+	// Make sure the reserved space of the boot sector is empty (as it should be for a valid FAT32 partition)
+	size_t offset;
+	for (offset = 0; offset < sizeof(data->fat32.reserved2); ++offset) {
+		if (data->fat32.reserved2[offset] != 0) {
+			errx(1, "Reserved space of boot sector is not zero. Exiting...");
+		}
+	}
+
+	// Checking if the number of clusters is valid
+	unsigned long dataSec = data->total_sectors
+			- (data->reserved_sectors
+					+ (data->fat32.sectors_per_fat * data->fat_count));
+	unsigned long count_clusters = dataSec / data->sectors_per_cluster;
+
+	if (count_clusters < MIN_NB_OF_SECTORS) {
+		errx(1, "Invalid number of sectors for FAT32. Exiting...");
+	}
+}
+
+/*
+ * Read and validate the boot sector of the already opened device, and set up
+ * an empty FAT that is filled one chunk at a time by fat_load_chunk().
+ * Be careful since this function ends the program if the boot sector is invalid
+ */
+void fat_open(struct vfat_data *vol) {
+	// Read the boot sector
+	if (vfat_dev_pread(vol, &vol->boot, sizeof(vol->boot), 0) != sizeof(vol->boot)) {
+		errx(1, "Couldn't read the boot sector. Exiting...");
+	}
+	check_boot_validity(&vol->boot);
+
+	// Compute some useful values
+	vol->fat_begin = sectors_to_bytes(vol, vol->boot.reserved_sectors);
+	vol->fat_size = sectors_to_bytes(vol, vol->boot.fat32.sectors_per_fat);
+	vol->clusters_begin = sectors_to_bytes(vol,
+			vol->boot.reserved_sectors
+					+ vol->boot.fat32.sectors_per_fat * vol->boot.fat_count);
+	vol->clusters_size = sectors_to_bytes(vol, vol->boot.sectors_per_cluster);
+	vol->clusters_count = (vol->boot.total_sectors
+			- (vol->boot.reserved_sectors
+					+ vol->boot.fat32.sectors_per_fat * vol->boot.fat_count))
+			/ vol->boot.sectors_per_cluster;
+
+	// Big allocations are mapped lazily, so this doesn't depend on the FAT size
+	vol->fat_content = malloc(vol->fat_size);
+	vol->fat_chunks = (vol->fat_size + FAT_CHUNK_SIZE - 1) / FAT_CHUNK_SIZE;
+	vol->fat_loaded = calloc(vol->fat_chunks, 1);
+	if (vol->fat_content == NULL || vol->fat_loaded == NULL) {
+		errx(1, "Could't allocate the FAT. Exiting...");
+	}
+	pthread_mutex_init(&vol->fat_lock, NULL);
+	vol->free_clusters = 0;
+}
+
+/*
+ * Read a chunk of the FAT if nobody did yet, and count its free clusters.
+ * Returns 0 on success or a negative errno value.
+ */
+int fat_load_chunk(struct vfat_data *vol, size_t chunk) {
+	size_t begin = chunk * FAT_CHUNK_SIZE;
+	size_t len = vol->fat_size - begin;
+	uint32_t first, last, max_cluster = fat_max_cluster(vol);
+	struct fat_scan scan;
+	size_t done = 0;
+
+	if (__atomic_load_n(&vol->fat_loaded[chunk], __ATOMIC_ACQUIRE))
+		return 0;
+
+	if (len > FAT_CHUNK_SIZE)
+		len = FAT_CHUNK_SIZE;
+
+	// Serializes the loads, the chunk may have been read while we waited
+	pthread_mutex_lock(&vol->fat_lock);
+	if (vol->fat_loaded[chunk]) {
+		pthread_mutex_unlock(&vol->fat_lock);
+		return 0;
+	}
+
+	while (done < len) {
+		ssize_t n = vfat_dev_pread(vol, (uint8_t*) vol->fat_content + begin + done,
+				len - done, vol->fat_begin + begin + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			pthread_mutex_unlock(&vol->fat_lock);
+			return n < 0 ? -errno : -EIO;
+		}
+		done += n;
+	}
+
+	// Clusters #0 and #1 are reserved, entries past max_cluster don't count
+	first = begin / sizeof(uint32_t);
+	last = (begin + len) / sizeof(uint32_t) - 1;
+	if (first < 2)
+		first = 2;
+	if (last > max_cluster)
+		last = max_cluster;
+	if (first <= last) {
+		fat_scan_range(vol->fat_content, first, last, max_cluster, &scan);
+		__atomic_add_fetch(&vol->free_clusters, scan.free, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&vol->fat_loaded[chunk], 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&vol->fat_chunks_loaded, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&vol->fat_lock);
+
+	return 0;
+}
+
+/*
+ * Read all the chunks of the FAT that aren't loaded yet
+ * Returns 0 on success or a negative errno value.
+ */
+int fat_load_all(struct vfat_data *vol) {
+	size_t chunk;
+	int res;
+
+	if (fat_loaded_all(vol))
+		return 0;
+
+	for (chunk = 0; chunk < vol->fat_chunks; ++chunk) {
+		if ((res = fat_load_chunk(vol, chunk)) != 0)
+			return res;
+	}
+	return 0;
+}
+
+/*
+ * Read and validate the boot sector of the already opened device, then load the whole FAT
+ * Be careful since this function ends the program if the boot sector is invalid
+ */
+void fat_load(struct vfat_data *vol) {
+	fat_open(vol);
+	if (fat_load_all(vol) != 0) {
+		errx(1, "Could't read the FAT. Exiting...");
+	}
+}
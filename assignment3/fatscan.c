@@ -0,0 +1,155 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Scans over the whole FAT, used for free space accounting and chain validation
+ *
+ * There are tens of millions of entries on big volumes, so the scan comes in
+ * SSE2 and AVX2 flavours on x86, picked at runtime, with a scalar fallback.
+ * All of them mask the 4 reserved upper bits before looking at an entry.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FATSCAN_X86
+#endif
+
+#include "vfat.h"
+
+/*
+ * Classify a single entry
+ */
+static inline void fat_scan_entry(uint32_t entry, uint32_t max_cluster,
+		struct fat_scan *res) {
+	entry &= FAT_ENTRY_MASK;
+
+	if (entry == 0)
+		++res->free;
+	else if (entry >= FAT_ENTRY_EOC)
+		++res->eoc;
+	else if (entry != FAT_ENTRY_BAD && (entry < 2 || entry > max_cluster))
+		++res->bad_links;
+}
+
+static void fat_scan_scalar(const uint32_t *fat, size_t count,
+		uint32_t max_cluster, struct fat_scan *res) {
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		fat_scan_entry(fat[i], max_cluster, res);
+}
+
+#ifdef FATSCAN_X86
+
+/*
+ * Masked entries are below 2^28, so signed 32 bits comparisons are fine.
+ * Each lane counts at most 2^28 entries, so the 32 bits counters can't overflow.
+ */
+__attribute__((target("sse2")))
+static size_t fat_scan_sse2(const uint32_t *fat, size_t count,
+		uint32_t max_cluster, struct fat_scan *res) {
+	const __m128i mask = _mm_set1_epi32(FAT_ENTRY_MASK);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i bad = _mm_set1_epi32(FAT_ENTRY_BAD);
+	const __m128i last_link = _mm_set1_epi32(FAT_ENTRY_EOC - 1);
+	const __m128i max = _mm_set1_epi32(max_cluster);
+	__m128i nr_free = zero, nr_eoc = zero, nr_bad_links = zero;
+	uint32_t lanes[4];
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*) (fat + i)),
+				mask);
+		__m128i is_eoc = _mm_cmpgt_epi32(v, last_link);
+		__m128i out = _mm_or_si128(_mm_cmpeq_epi32(v, one),
+				_mm_andnot_si128(_mm_or_si128(is_eoc, _mm_cmpeq_epi32(v, bad)),
+						_mm_cmpgt_epi32(v, max)));
+
+		// Comparisons give -1 for true lanes
+		nr_free = _mm_sub_epi32(nr_free, _mm_cmpeq_epi32(v, zero));
+		nr_eoc = _mm_sub_epi32(nr_eoc, is_eoc);
+		nr_bad_links = _mm_sub_epi32(nr_bad_links, out);
+	}
+
+	_mm_storeu_si128((__m128i*) lanes, nr_free);
+	res->free += (size_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm_storeu_si128((__m128i*) lanes, nr_eoc);
+	res->eoc += (size_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm_storeu_si128((__m128i*) lanes, nr_bad_links);
+	res->bad_links += (size_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t fat_scan_avx2(const uint32_t *fat, size_t count,
+		uint32_t max_cluster, struct fat_scan *res) {
+	const __m256i mask = _mm256_set1_epi32(FAT_ENTRY_MASK);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i bad = _mm256_set1_epi32(FAT_ENTRY_BAD);
+	const __m256i last_link = _mm256_set1_epi32(FAT_ENTRY_EOC - 1);
+	const __m256i max = _mm256_set1_epi32(max_cluster);
+	__m256i nr_free = zero, nr_eoc = zero, nr_bad_links = zero;
+	uint32_t lanes[8];
+	size_t i, j;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_and_si256(
+				_mm256_loadu_si256((const __m256i*) (fat + i)), mask);
+		__m256i is_eoc = _mm256_cmpgt_epi32(v, last_link);
+		__m256i out = _mm256_or_si256(_mm256_cmpeq_epi32(v, one),
+				_mm256_andnot_si256(
+						_mm256_or_si256(is_eoc, _mm256_cmpeq_epi32(v, bad)),
+						_mm256_cmpgt_epi32(v, max)));
+
+		nr_free = _mm256_sub_epi32(nr_free, _mm256_cmpeq_epi32(v, zero));
+		nr_eoc = _mm256_sub_epi32(nr_eoc, is_eoc);
+		nr_bad_links = _mm256_sub_epi32(nr_bad_links, out);
+	}
+
+	_mm256_storeu_si256((__m256i*) lanes, nr_free);
+	for (j = 0; j < 8; ++j)
+		res->free += lanes[j];
+	_mm256_storeu_si256((__m256i*) lanes, nr_eoc);
+	for (j = 0; j < 8; ++j)
+		res->eoc += lanes[j];
+	_mm256_storeu_si256((__m256i*) lanes, nr_bad_links);
+	for (j = 0; j < 8; ++j)
+		res->bad_links += lanes[j];
+
+	return i;
+}
+
+#endif
+
+/*
+ * Scan the FAT entries of clusters #first to #last
+ */
+void fat_scan_range(const uint32_t *fat, uint32_t first, uint32_t last,
+		uint32_t max_cluster, struct fat_scan *res) {
+	size_t count = last >= first ? (size_t) last - first + 1 : 0;
+	size_t done = 0;
+
+	memset(res, 0, sizeof(*res));
+	fat += first;
+
+#ifdef FATSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		done = fat_scan_avx2(fat, count, max_cluster, res);
+	else if (__builtin_cpu_supports("sse2"))
+		done = fat_scan_sse2(fat, count, max_cluster, res);
+#endif
+
+	// Whatever is left after the vector loop
+	fat_scan_scalar(fat + done, count - done, max_cluster, res);
+}
+
+/*
+ * Scan the FAT entries of clusters #2 to #max_cluster
+ */
+void fat_scan(const uint32_t *fat, uint32_t max_cluster, struct fat_scan *res) {
+	fat_scan_range(fat, 2, max_cluster, max_cluster, res); // The first two entries are reserved
+}
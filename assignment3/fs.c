@@ -0,0 +1,639 @@
+// vim: noet:ts=8:sts=8
+/*
+ * File system operations shared by the high-level (vfat.c) and the
+ * low-level (vfat_ll.c) FUSE frontends
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define DIRECTORY_RECORD_SIZE 32
+#define DCACHE_SIZE 4096 // Has to be a power of 2
+
+// Cached result of a name lookup in a directory
+struct dcache_entry {
+	const struct vfat_data *vol;
+	uint32_t dir_cluster; // 0 when the slot is unused
+	struct vfat_dirent de;
+};
+
+struct vfat_data **vfat_volumes;
+size_t vfat_nr_volumes;
+
+/*
+ * Direct-mapped, so that lookups and insertions never allocate. Shared by all
+ * the volumes so that its size doesn't grow with the number of images.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct dcache_entry slots[DCACHE_SIZE];
+} dcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Reads the FAT and the root directories after the mount, see vfat_start_loader()
+static struct {
+	pthread_t thread;
+	int running;
+	int stop;
+} loader;
+
+/*
+ * Register a volume whose boot sector and FAT have been loaded
+ */
+int vfat_add_volume(struct vfat_data *vol) {
+	struct vfat_data **grown;
+
+	grown = realloc(vfat_volumes, (vfat_nr_volumes + 1) * sizeof(*grown));
+	if (grown == NULL)
+		return -ENOMEM;
+	vfat_volumes = grown;
+	vol->index = vfat_nr_volumes;
+	vfat_volumes[vfat_nr_volumes++] = vol;
+	return 0;
+}
+
+/*
+ * Read one cluster to the specified buffer
+ * Returns 0 on success or a negative errno value.
+ */
+int read_cluster(struct vfat_data *vol, void* buffer, size_t cluster_number) {
+	struct sparse_cursor cursor = { 0, 0, 0 };
+	size_t done = 0;
+
+	// Nothing dirties the cache most of the time, skip its lock then
+	if (wb_has_dirty(vol)) {
+		if (wb_read_cluster(vol, buffer, cluster_number)) {
+			stats_add(STAT_WB_DIR_HIT, 1);
+			return 0; // The cluster is dirty, the device content is stale
+		}
+		stats_add(STAT_WB_DIR_MISS, 1);
+	}
+
+	if (sparse_is_hole(vol, &cursor, cluster_to_bytes(vol, cluster_number),
+			vol->clusters_size)) {
+		memset(buffer, 0, vol->clusters_size);
+		stats_add(STAT_HOLE_BYTES, vol->clusters_size);
+		return 0;
+	}
+
+	// pread() since several FUSE threads share the file descriptor
+	while (done < vol->clusters_size) {
+		ssize_t n = vfat_dev_pread(vol, (uint8_t*) buffer + done,
+				vol->clusters_size - done,
+				cluster_to_bytes(vol, cluster_number) + done);
+		stats_add(STAT_SYSCALLS, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		stats_add(STAT_BYTES_READ, n);
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Read the directory entry stored at pos on the device
+ */
+int vfat_read_direntry(struct vfat_data *vol, off_t pos,
+		struct fat32_direntry *entry) {
+	uint32_t cluster;
+	size_t in_cluster;
+
+	if (pos < (off_t) vol->clusters_begin)
+		return -EINVAL;
+
+	// The directory cluster may be dirty
+	cluster = (pos - vol->clusters_begin) / vol->clusters_size + 2;
+	in_cluster = (pos - vol->clusters_begin) % vol->clusters_size;
+	if (wb_has_dirty(vol)
+			&& wb_read_range(vol, entry, cluster, in_cluster, sizeof(*entry)))
+		return 0;
+
+	stats_add(STAT_SYSCALLS, 1);
+	if (vfat_dev_pread(vol, entry, sizeof(*entry), pos) != sizeof(*entry))
+		return -EIO;
+	stats_add(STAT_BYTES_READ, sizeof(*entry));
+	return 0;
+}
+
+/*
+ * Call cb for every short entry of the directory starting at first_cluster,
+ * following its whole chain. Unused entries, long file name entries and the
+ * volume label are skipped. Stops early when cb returns something else than 0.
+ * A chain longer than the volume loops back on itself, that's -EIO.
+ * Returns the value of the last cb call, or a negative errno value.
+ */
+int vfat_iterate_dir(struct vfat_data *vol, uint32_t first_cluster,
+		vfat_dir_cb cb, void *data) {
+	uint8_t cluster[vol->clusters_size];
+	uint32_t max_cluster = fat_max_cluster(vol);
+	uint32_t current = first_cluster;
+	size_t walked = 0;
+	struct vfat_dirent de;
+	int res;
+
+	while (current >= 2 && current <= max_cluster) {
+		size_t offset;
+
+		if (walked++ == vol->clusters_count)
+			return -EIO; // Corrupted image
+		if ((res = read_cluster(vol, cluster, current)) != 0)
+			return res;
+
+		for (offset = 0; offset < vol->clusters_size; offset +=
+				DIRECTORY_RECORD_SIZE) {
+			if (cluster[offset] == 0)
+				return 0; // End of directory
+			if (cluster[offset] == 0xE5)
+				continue; // Unused entry
+
+			memcpy(&de.entry, &cluster[offset], sizeof(de.entry));
+			if ((de.entry.attr & VFAT_ATTR_LFN) == VFAT_ATTR_LFN
+					|| (de.entry.attr & VFAT_ATTR_VOLUME_ID))
+				continue;
+
+			trim_filename(de.name, de.entry.nameext);
+			de.pos = cluster_to_bytes(vol, current) + offset;
+
+			if ((res = cb(&de, data)) != 0)
+				return res;
+		}
+
+		current = fat_entry(vol, current);
+	}
+
+	return 0;
+}
+
+static inline size_t dcache_slot(const struct vfat_data *vol,
+		uint32_t dir_cluster, const char *name, size_t length) {
+	// FNV-1a, seeded with the directory
+	uint32_t hash = 2166136261u ^ dir_cluster ^ (uint32_t) (uintptr_t) vol;
+	size_t i;
+
+	for (i = 0; i < length; ++i)
+		hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+	return hash & (DCACHE_SIZE - 1);
+}
+
+/*
+ * Forget every cached lookup, has to be called when a directory is modified
+ */
+void vfat_dcache_invalidate(void) {
+	size_t i;
+
+	pthread_mutex_lock(&dcache.lock);
+	for (i = 0; i < DCACHE_SIZE; ++i)
+		dcache.slots[i].dir_cluster = 0;
+	pthread_mutex_unlock(&dcache.lock);
+}
+
+static void dcache_insert(const struct vfat_data *vol, uint32_t dir_cluster,
+		const struct vfat_dirent *de) {
+	struct dcache_entry *slot = &dcache.slots[dcache_slot(vol, dir_cluster,
+			de->name, strlen(de->name))];
+
+	pthread_mutex_lock(&dcache.lock);
+	slot->vol = vol;
+	slot->dir_cluster = dir_cluster;
+	slot->de = *de;
+	pthread_mutex_unlock(&dcache.lock);
+}
+
+// Used by vfat_lookup_match()
+struct vfat_lookup_data {
+	const char *name;
+	size_t length;
+	struct vfat_dirent *found;
+};
+
+static int vfat_lookup_match(const struct vfat_dirent *de, void *data) {
+	struct vfat_lookup_data *ld = data;
+
+	if (strncmp(de->name, ld->name, ld->length) != 0
+			|| de->name[ld->length] != '\0')
+		return 0;
+
+	*ld->found = *de;
+	return 1;
+}
+
+/*
+ * Find the entry called name (length bytes, not necessarily NUL-terminated)
+ * in the directory starting at dir_cluster.
+ * Returns 1 if found, 0 if not, or a negative errno value.
+ */
+int vfat_lookup(struct vfat_data *vol, uint32_t dir_cluster, const char *name,
+		size_t length, struct vfat_dirent *found) {
+	struct vfat_lookup_data ld = { name, length, found };
+	struct dcache_entry *slot;
+	int res;
+
+	if (length >= sizeof(found->name))
+		return 0; // Longer than any short name
+
+	slot = &dcache.slots[dcache_slot(vol, dir_cluster, name, length)];
+
+	pthread_mutex_lock(&dcache.lock);
+	if (slot->vol == vol && slot->dir_cluster == dir_cluster
+			&& strncmp(slot->de.name, name, length) == 0
+			&& slot->de.name[length] == '\0') {
+		*found = slot->de;
+		pthread_mutex_unlock(&dcache.lock);
+		stats_add(STAT_DENTRY_HIT, 1);
+		return 1;
+	}
+	pthread_mutex_unlock(&dcache.lock);
+	stats_add(STAT_DENTRY_MISS, 1);
+
+	res = vfat_iterate_dir(vol, dir_cluster, vfat_lookup_match, &ld);
+	if (res > 0)
+		dcache_insert(vol, dir_cluster, found);
+
+	return res;
+}
+
+// Used by vfat_dcache_warm()
+struct vfat_warm_data {
+	struct vfat_data *vol;
+	uint32_t dir_cluster;
+};
+
+static int vfat_warm_entry(const struct vfat_dirent *de, void *data) {
+	struct vfat_warm_data *wd = data;
+
+	dcache_insert(wd->vol, wd->dir_cluster, de);
+	return __atomic_load_n(&loader.stop, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read a whole directory and cache all its entries, so that the first lookups
+ * in it don't have to go to the device
+ */
+static void vfat_dcache_warm(struct vfat_data *vol, uint32_t dir_cluster) {
+	struct vfat_warm_data wd = { vol, dir_cluster };
+	int res;
+
+	res = vfat_iterate_dir(vol, dir_cluster, vfat_warm_entry, &wd);
+	if (res < 0)
+		vlog(VLOG_WARN, "%s: can't read the root directory (%d)", vol->dev, res);
+}
+
+static void *vfat_loader_main(void *arg) {
+	size_t i, chunk;
+	int res;
+
+	// The first requests are most likely about the root directories
+	for (i = 0; i < vfat_nr_volumes; ++i) {
+		if (__atomic_load_n(&loader.stop, __ATOMIC_RELAXED))
+			return NULL;
+		vfat_dcache_warm(vfat_volumes[i], vfat_volumes[i]->boot.fat32.root_cluster);
+	}
+
+	for (i = 0; i < vfat_nr_volumes; ++i) {
+		struct vfat_data *vol = vfat_volumes[i];
+
+		sparse_scan(vol);
+		for (chunk = 0; chunk < vol->fat_chunks; ++chunk) {
+			if (__atomic_load_n(&loader.stop, __ATOMIC_RELAXED))
+				return NULL;
+			if ((res = fat_load_chunk(vol, chunk)) != 0) {
+				// Requests will retry the chunk when they need it
+				vlog(VLOG_ERROR, "%s: can't read the FAT (%d)", vol->dev, res);
+				break;
+			}
+		}
+		if (fat_loaded_all(vol))
+			vlog(VLOG_INFO, "%s: %zu clusters of %zu bytes, %zu free", vol->dev,
+					vol->clusters_count, vol->clusters_size,
+					__atomic_load_n(&vol->free_clusters, __ATOMIC_RELAXED));
+	}
+	return NULL;
+}
+
+/*
+ * Load the FAT of every volume, map the holes of the images and warm up their
+ * root directory in the background, while requests read the chunks they need on demand. Has to be
+ * called from the FUSE init callback since fuse_main() forks when going to the
+ * background.
+ */
+void vfat_start_loader(void) {
+	loader.stop = 0;
+	if (pthread_create(&loader.thread, NULL, vfat_loader_main, NULL) == 0)
+		loader.running = 1;
+	else
+		vlog(VLOG_WARN, "no background loader, the FAT is read on demand");
+}
+
+void vfat_stop_loader(void) {
+	if (!loader.running)
+		return;
+	__atomic_store_n(&loader.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(loader.thread, NULL);
+	loader.running = 0;
+}
+
+/*
+ * Days from 1970-01-01 to the first day of every month of 1980 to 2107,
+ * indexed by the year and month bits of a DOS date (date >> 5). -1 for the
+ * months that don't exist (0, 13 to 15).
+ */
+static int32_t dos_month_days[1 << 11];
+
+/*
+ * Fill the calendar table once, so that decoding a date is a lookup
+ */
+void vfat_time_init(void) {
+	static const uint16_t month_start[12] = {
+		0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+	};
+	int32_t days = 3652; // 1970 to 1980, with 1972 and 1976 leap years
+	unsigned int year, month;
+
+	for (year = 0; year < 128; ++year) {
+		unsigned int y = 1980 + year;
+		int leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+
+		for (month = 0; month < 16; ++month) {
+			if (month < 1 || month > 12)
+				dos_month_days[year << 4 | month] = -1;
+			else
+				dos_month_days[year << 4 | month] = days
+						+ month_start[month - 1] + (leap && month > 2);
+		}
+		days += 365 + leap;
+	}
+}
+
+/*
+ * Seconds since the epoch of a DOS date and time. FAT doesn't record the
+ * time zone, they're taken as UTC. Unset or invalid dates give 0.
+ */
+static time_t dos_time(uint16_t date, uint16_t time) {
+	int32_t days = dos_month_days[date >> 5];
+	unsigned int day = date & 0x1f;
+
+	if (days < 0 || day == 0)
+		return 0;
+	return (time_t) (days + day - 1) * 86400 + (time >> 11) * 3600
+			+ ((time >> 5) & 0x3f) * 60 + (time & 0x1f) * 2;
+}
+
+/*
+ * Attributes of a directory entry
+ */
+void vfat_fill_stat(const struct fat32_direntry *entry, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO
+			| ((entry->attr & VFAT_ATTR_DIR) ? S_IFDIR : S_IFREG);
+	st->st_nlink = 1;
+	st->st_uid = mount_uid;
+	st->st_gid = mount_gid;
+	st->st_size = (entry->attr & VFAT_ATTR_DIR) ? 0 : entry->size;
+	st->st_blocks = (st->st_size + 511) / 512;
+	st->st_ino = direntry_cluster(entry);
+
+	// The creation time has a 10 ms resolution, the others 2 s and 1 day
+	st->st_mtime = dos_time(entry->mtime_date, entry->mtime_time);
+	st->st_atime = dos_time(entry->atime_date, 0);
+	st->st_ctime = dos_time(entry->ctime_date, entry->ctime_time);
+	if (st->st_ctime) {
+		st->st_ctime += entry->ctime_ms / 100;
+#ifndef __APPLE__
+		st->st_ctim.tv_nsec = entry->ctime_ms % 100 * 10000000L;
+#endif
+	}
+}
+
+/*
+ * Attributes of the root directory, which has no directory entry
+ */
+void vfat_fill_root_stat(struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
+	st->st_nlink = 1;
+	st->st_uid = mount_uid;
+	st->st_gid = mount_gid;
+	st->st_blocks = 1;
+	st->st_mtime = st->st_atime = st->st_ctime = mount_time;
+}
+
+/*
+ * Volume statistics, the number of free clusters is maintained by wb_set_fat().
+ * With a NULL volume, the totals of all the volumes (in 512 bytes blocks).
+ * Returns 0 on success or a negative errno value if the FAT can't be read.
+ */
+int vfat_fill_statfs(struct vfat_data *vol, struct statvfs *st) {
+	size_t i;
+	int res;
+
+	memset(st, 0, sizeof(*st));
+	st->f_namemax = 255;
+
+	if (vol) {
+		// The free clusters are only all counted once the whole FAT is read
+		res = fat_load_all(vol);
+		if (res < 0)
+			return res;
+		st->f_bsize = vol->clusters_size;
+		st->f_frsize = vol->clusters_size;
+		st->f_blocks = fat_max_cluster(vol) - 1;
+		st->f_bfree = vol->free_clusters;
+		st->f_bavail = vol->free_clusters;
+		if (vol->readonly)
+			st->f_flag = ST_RDONLY;
+		return 0;
+	}
+
+	st->f_bsize = 512;
+	st->f_frsize = 512;
+	for (i = 0; i < vfat_nr_volumes; ++i) {
+		size_t sectors = vfat_volumes[i]->clusters_size / 512;
+
+		res = fat_load_all(vfat_volumes[i]);
+		if (res < 0)
+			return res;
+		st->f_blocks += (fsblkcnt_t) (fat_max_cluster(vfat_volumes[i]) - 1)
+				* sectors;
+		st->f_bfree += (fsblkcnt_t) vfat_volumes[i]->free_clusters * sectors;
+	}
+	st->f_bavail = st->f_bfree;
+	return 0;
+}
+
+/*
+ * Map size bytes at offs of the file starting at first_cluster to runs of
+ * contiguous clusters on the device. Runs are split where they go in or out of
+ * a hole of the image. The caller has to clamp size to the file size.
+ * Returns the number of extents (stored in a malloc'ed array) or a negative errno.
+ */
+int vfat_map_extents(struct vfat_data *vol, uint32_t first_cluster, off_t offs,
+		size_t size, struct vfat_extent **extents) {
+	uint32_t cluster = first_cluster;
+	uint32_t max_cluster = fat_max_cluster(vol);
+	size_t skip = offs / vol->clusters_size;
+	size_t in_cluster = offs % vol->clusters_size;
+	struct sparse_cursor cursor = { 0, 0, 0 };
+	int count = 0, capacity = 0;
+
+	*extents = NULL;
+
+	// Skip the clusters before offs
+	while (skip-- > 0) {
+		if (cluster < 2 || cluster > max_cluster)
+			return -EIO;
+		cluster = fat_entry(vol, cluster);
+	}
+
+	while (size > 0) {
+		size_t len = vol->clusters_size - in_cluster;
+		struct vfat_extent *ext;
+		off_t pos;
+		int hole;
+
+		if (cluster < 2 || cluster > max_cluster) {
+			free(*extents);
+			*extents = NULL;
+			return -EIO; // Chain shorter than the file or corrupted
+		}
+		if (len > size)
+			len = size;
+		pos = cluster_to_bytes(vol, cluster) + in_cluster;
+		hole = sparse_is_hole(vol, &cursor, pos, len);
+
+		ext = count > 0 ? &(*extents)[count - 1] : NULL;
+		if (ext && ext->pos + ext->len == pos && ext->hole == hole) {
+			ext->len += len; // Contiguous with the previous cluster
+			stats_add(STAT_EXTENTS_MERGED, 1);
+		} else {
+			if (count == capacity) {
+				struct vfat_extent *grown;
+
+				capacity = capacity ? capacity * 2 : 8;
+				grown = realloc(*extents, capacity * sizeof(*grown));
+				if (grown == NULL) {
+					free(*extents);
+					*extents = NULL;
+					return -ENOMEM;
+				}
+				*extents = grown;
+			}
+			ext = &(*extents)[count++];
+			ext->pos = pos;
+			ext->len = len;
+			ext->cluster = cluster;
+			ext->hole = hole;
+		}
+
+		size -= len;
+		in_cluster = 0;
+		cluster = fat_entry(vol, cluster);
+	}
+
+	return count;
+}
+
+/*
+ * Whether the runs of clusters mapped by vfat_map_extents() can be spliced
+ * straight from the image file. They can't if some clusters are only up to
+ * date in memory, are zero-filled, or if the image is compressed.
+ */
+int vfat_can_splice(struct vfat_data *vol, const struct vfat_extent *extents,
+		int count) {
+	int i;
+
+	if (!vol->backend.ops->direct || wb_has_dirty(vol))
+		return 0;
+	for (i = 0; i < count; ++i) {
+		if (extents[i].hole)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Read the runs of clusters mapped by vfat_map_extents() to buf, taking the
+ * dirty clusters from the write-back cache. Runs in holes are zero-filled.
+ * Returns the number of bytes read or a negative errno value.
+ */
+int vfat_read_extents(struct vfat_data *vol, const struct vfat_extent *extents,
+		int count, char *buf) {
+	size_t done = 0;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		size_t len = 0;
+
+		if (extents[i].hole) {
+			memset(buf + done, 0, extents[i].len);
+			stats_add(STAT_HOLE_BYTES, extents[i].len);
+			len = extents[i].len;
+		}
+
+		while (len < extents[i].len) {
+			ssize_t n = vfat_dev_pread(vol, buf + done + len,
+					extents[i].len - len, extents[i].pos + len);
+			stats_add(STAT_SYSCALLS, 1);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return n < 0 ? -errno : -EIO;
+			stats_add(STAT_BYTES_READ, n);
+			len += n;
+		}
+
+		// Clusters that are dirty in the write-back cache are newer than the device
+		if (wb_has_dirty(vol)) {
+			size_t pos = 0;
+			uint32_t cluster = extents[i].cluster;
+			size_t in_cluster = (extents[i].pos - cluster_to_bytes(vol, cluster));
+
+			while (pos < extents[i].len) {
+				size_t chunk = vol->clusters_size - in_cluster;
+				if (chunk > extents[i].len - pos)
+					chunk = extents[i].len - pos;
+				if (wb_read_range(vol, buf + done + pos, cluster++, in_cluster, chunk))
+					stats_add(STAT_WB_DATA_HIT, 1);
+				else
+					stats_add(STAT_WB_DATA_MISS, 1);
+				pos += chunk;
+				in_cluster = 0;
+			}
+		}
+
+		done += extents[i].len;
+	}
+
+	return done;
+}
+
+/*
+ * Read size bytes at offs of the file starting at first_cluster.
+ * The caller has to clamp size to the file size.
+ * Returns the number of bytes read or a negative errno value.
+ */
+int vfat_read_file(struct vfat_data *vol, uint32_t first_cluster, char *buf,
+		size_t size, off_t offs) {
+	struct vfat_extent *extents;
+	int count, res;
+
+	if (size == 0)
+		return 0;
+
+	count = vfat_map_extents(vol, first_cluster, offs, size, &extents);
+	if (count < 0)
+		return count;
+
+	res = vfat_read_extents(vol, extents, count, buf);
+	free(extents);
+	return res;
+}
+
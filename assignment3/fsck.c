@@ -0,0 +1,475 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Consistency checker for FAT32 images
+ *
+ * usage: vfat_fsck [-j threads] image
+ *
+ * Checks the boot sector, compares the copies of the FAT, then walks the
+ * directory tree to verify every cluster chain, detect cross-linked clusters
+ * and finally lost clusters (allocated in the FAT but not referenced).
+ * Directories are spread over a pool of threads, each with its own work queue;
+ * idle threads steal work from the others. The clusters of one directory are
+ * checked in chain order, since an end of directory marker ends the whole
+ * directory and not just its cluster.
+ *
+ * Exits with 0 if the image is clean, 1 otherwise.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define DIRECTORY_RECORD_SIZE 32
+#define FAT_COMPARE_CHUNK (1 << 20) // bytes of the FAT compared at once
+#define MAX_REPORTED_MISMATCHES 10
+
+// A directory being checked
+struct fsck_dir {
+	struct fsck_dir *next; // All directories, freed at exit
+	size_t length; // Clusters of its chain that check_chain() accepted
+	char path[];
+};
+
+// One directory cluster to check
+struct fsck_work {
+	uint32_t cluster;
+	size_t index; // Position of the cluster in the chain of the directory
+	struct fsck_dir *dir;
+};
+
+// Per-thread work queue. The owner works at the tail, thieves steal at the head.
+struct fsck_deque {
+	pthread_mutex_t lock;
+	struct fsck_work *items;
+	size_t head, tail, capacity;
+};
+
+static struct vfat_data volume;
+
+static struct {
+	int nthreads;
+	struct fsck_deque *deques;
+	size_t pending; // Work items queued or being processed
+
+	uint32_t max_cluster;
+	uint64_t *used; // One bit per cluster referenced by a chain
+
+	size_t errors;
+	size_t files;
+	size_t directories;
+
+	pthread_mutex_t dirs_lock;
+	struct fsck_dir *dirs;
+	pthread_mutex_t report_lock;
+} fsck = { .dirs_lock = PTHREAD_MUTEX_INITIALIZER, .report_lock =
+		PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Print an error about the image
+ */
+static void report(const char *fmt, ...) {
+	va_list ap;
+
+	__atomic_add_fetch(&fsck.errors, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&fsck.report_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	pthread_mutex_unlock(&fsck.report_lock);
+}
+
+static struct fsck_dir *new_dir(const struct fsck_dir *parent, const char *name) {
+	size_t len = (parent ? strlen(parent->path) : 0) + strlen(name) + 2;
+	struct fsck_dir *dir = malloc(sizeof(*dir) + len);
+
+	if (dir == NULL)
+		err(1, "malloc");
+	snprintf(dir->path, len, "%s/%s", parent ? parent->path : "", name);
+
+	pthread_mutex_lock(&fsck.dirs_lock);
+	dir->next = fsck.dirs;
+	fsck.dirs = dir;
+	pthread_mutex_unlock(&fsck.dirs_lock);
+
+	return dir;
+}
+
+static void push_work(struct fsck_deque *dq, uint32_t cluster, size_t index,
+		struct fsck_dir *dir) {
+	__atomic_add_fetch(&fsck.pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->capacity) {
+		if (dq->head > dq->capacity / 2) {
+			// Mostly stolen from, just move the remaining items back to the front
+			memmove(dq->items, dq->items + dq->head,
+					(dq->tail - dq->head) * sizeof(*dq->items));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			dq->capacity = dq->capacity ? dq->capacity * 2 : 64;
+			dq->items = realloc(dq->items, dq->capacity * sizeof(*dq->items));
+			if (dq->items == NULL)
+				err(1, "realloc");
+		}
+	}
+	dq->items[dq->tail].cluster = cluster;
+	dq->items[dq->tail].index = index;
+	dq->items[dq->tail].dir = dir;
+	++dq->tail;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static int pop_work(struct fsck_deque *dq, struct fsck_work *w) {
+	int found = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*w = dq->items[--dq->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return found;
+}
+
+static int steal_work(int self, struct fsck_work *w) {
+	int i;
+
+	for (i = 1; i < fsck.nthreads; ++i) {
+		struct fsck_deque *dq = &fsck.deques[(self + i) % fsck.nthreads];
+		int found = 0;
+
+		pthread_mutex_lock(&dq->lock);
+		if (dq->tail > dq->head) {
+			*w = dq->items[dq->head++];
+			found = 1;
+		}
+		pthread_mutex_unlock(&dq->lock);
+
+		if (found)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Mark the cluster as referenced. Returns 1 if it already was.
+ */
+static int mark_used(uint32_t cluster) {
+	uint64_t bit = (uint64_t) 1 << (cluster % 64);
+
+	return (__atomic_fetch_or(&fsck.used[cluster / 64], bit, __ATOMIC_RELAXED)
+			& bit) != 0;
+}
+
+static int is_used(uint32_t cluster) {
+	return (fsck.used[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+/*
+ * Follow the chain starting at first and check every link.
+ * For directories, the first cluster is queued to be checked, the next ones
+ * are queued by check_directory_cluster() as long as the directory goes on.
+ * For files, the length of the chain has to match the size.
+ */
+static void check_chain(struct fsck_deque *dq, uint32_t first, uint32_t size,
+		const char *path, struct fsck_dir *subdir) {
+	size_t expected = (size + volume.clusters_size - 1)
+			/ volume.clusters_size;
+	size_t length = 0;
+	uint32_t cluster = first;
+	int broken = 1; // Until the end of chain marker is found
+
+	if (first == 0) {
+		if (subdir)
+			report("%s: directory without any cluster", path);
+		else if (size > 0)
+			report("%s: %u bytes but no cluster", path, size);
+		return;
+	}
+
+	for (;;) {
+		uint32_t next;
+
+		if (cluster < 2 || cluster > fsck.max_cluster) {
+			report("%s: link to invalid cluster #%u", path, cluster);
+			break;
+		}
+		if (mark_used(cluster)) {
+			report("%s: cluster #%u is cross-linked", path, cluster);
+			break;
+		}
+		++length;
+
+		next = volume.fat_content[cluster] & FAT_ENTRY_MASK;
+		if (next >= FAT_ENTRY_EOC) {
+			broken = 0;
+			break;
+		}
+		if (next == FAT_ENTRY_BAD) {
+			report("%s: chain goes through bad cluster #%u", path, cluster);
+			break;
+		}
+		if (next == 0) {
+			report("%s: chain runs into free cluster #%u", path, cluster);
+			break;
+		}
+		cluster = next;
+	}
+
+	if (subdir) {
+		subdir->length = length;
+		if (length > 0)
+			push_work(dq, first, 0, subdir);
+	}
+
+	if (!subdir && !broken && length != expected) {
+		report("%s: %u bytes but chain has %zu clusters (expected %zu)",
+				path, size, length, expected);
+	}
+}
+
+/*
+ * Check all the entries of one directory cluster, then queue the next cluster
+ * of the directory unless an end of directory marker was found. Entries after
+ * the marker are stale, even in the following clusters.
+ */
+static void check_directory_cluster(struct fsck_deque *dq, uint8_t *cluster,
+		const struct fsck_work *w) {
+	ssize_t n = vfat_dev_pread(&volume, cluster, volume.clusters_size,
+			cluster_to_bytes(&volume, w->cluster));
+	size_t offset;
+
+	if (n != (ssize_t) volume.clusters_size) {
+		report("%s: can't read directory cluster #%u", w->dir->path,
+				w->cluster);
+		return;
+	}
+
+	for (offset = 0; offset < volume.clusters_size; offset +=
+			DIRECTORY_RECORD_SIZE) {
+		struct fat32_direntry entry;
+		char name[12];
+		char path[PATH_MAX];
+
+		if (cluster[offset] == 0)
+			return; // End of directory
+		if (cluster[offset] == 0xE5)
+			continue; // Unused entry
+
+		memcpy(&entry, &cluster[offset], sizeof(entry));
+		if ((entry.attr & VFAT_ATTR_LFN) == VFAT_ATTR_LFN
+				|| (entry.attr & VFAT_ATTR_VOLUME_ID))
+			continue;
+		if (entry.nameext[0] == '.')
+			continue; // "." and ".." point back to already checked directories
+
+		trim_filename(name, entry.nameext);
+		snprintf(path, sizeof(path), "%s/%s", w->dir->path, name);
+
+		if (entry.attr & VFAT_ATTR_DIR) {
+			__atomic_add_fetch(&fsck.directories, 1, __ATOMIC_RELAXED);
+			check_chain(dq, direntry_cluster(&entry), 0, path,
+					new_dir(w->dir, name));
+		} else {
+			__atomic_add_fetch(&fsck.files, 1, __ATOMIC_RELAXED);
+			check_chain(dq, direntry_cluster(&entry), entry.size, path, NULL);
+		}
+	}
+
+	if (w->index + 1 < w->dir->length)
+		push_work(dq, volume.fat_content[w->cluster] & FAT_ENTRY_MASK,
+				w->index + 1, w->dir);
+}
+
+static void *worker_main(void *arg) {
+	int self = (int) (long) arg;
+	struct fsck_deque *dq = &fsck.deques[self];
+	uint8_t *cluster = malloc(volume.clusters_size);
+	struct fsck_work w;
+
+	if (cluster == NULL)
+		err(1, "malloc");
+
+	for (;;) {
+		if (pop_work(dq, &w) || steal_work(self, &w)) {
+			check_directory_cluster(dq, cluster, &w);
+			__atomic_sub_fetch(&fsck.pending, 1, __ATOMIC_SEQ_CST);
+		} else if (__atomic_load_n(&fsck.pending, __ATOMIC_SEQ_CST) == 0) {
+			break; // Nothing queued and nobody can queue more
+		} else {
+			sched_yield();
+		}
+	}
+
+	free(cluster);
+	return NULL;
+}
+
+/*
+ * Compare every other copy of the FAT against the first one (already loaded)
+ */
+static void compare_fats(void) {
+	uint8_t *buffer = malloc(FAT_COMPARE_CHUNK);
+	size_t copy, offset, i;
+
+	if (buffer == NULL)
+		err(1, "malloc");
+
+	for (copy = 1; copy < volume.boot.fat_count; ++copy) {
+		size_t mismatches = 0;
+
+		for (offset = 0; offset < volume.fat_size; offset +=
+				FAT_COMPARE_CHUNK) {
+			size_t len = volume.fat_size - offset;
+			const uint32_t *first = (uint32_t*) ((uint8_t*) volume.fat_content
+					+ offset);
+			const uint32_t *other = (uint32_t*) buffer;
+
+			if (len > FAT_COMPARE_CHUNK)
+				len = FAT_COMPARE_CHUNK;
+			if (vfat_dev_pread(&volume, buffer, len,
+					volume.fat_begin + copy * volume.fat_size + offset)
+					!= (ssize_t) len) {
+				report("FAT #%zu: can't read at offset %zu", copy, offset);
+				break;
+			}
+			if (memcmp(first, other, len) == 0)
+				continue;
+
+			for (i = 0; i < len / sizeof(uint32_t); ++i) {
+				if (first[i] == other[i])
+					continue;
+				if (++mismatches <= MAX_REPORTED_MISMATCHES) {
+					report("FAT #%zu: entry #%zu is %08X instead of %08X", copy,
+							offset / sizeof(uint32_t) + i, other[i], first[i]);
+				}
+			}
+		}
+
+		if (mismatches > MAX_REPORTED_MISMATCHES)
+			report("FAT #%zu: %zu entries differ in total", copy, mismatches);
+	}
+
+	free(buffer);
+}
+
+/*
+ * Clusters allocated in the FAT that no chain reaches
+ */
+static void check_lost_clusters(void) {
+	size_t lost = 0;
+	uint32_t cluster;
+
+	for (cluster = 2; cluster <= fsck.max_cluster; ++cluster) {
+		uint32_t entry = volume.fat_content[cluster] & FAT_ENTRY_MASK;
+
+		if (entry != 0 && entry != FAT_ENTRY_BAD && !is_used(cluster))
+			++lost;
+	}
+
+	if (lost > 0)
+		report("%zu lost clusters", lost);
+}
+
+static void usage(void) {
+	errx(1, "usage: vfat_fsck [-j threads] image");
+}
+
+int main(int argc, char **argv) {
+	pthread_t *threads;
+	struct fsck_dir *root;
+	struct fat_scan scan;
+	long i;
+	int opt, res;
+
+	fsck.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			fsck.nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+	if (fsck.nthreads < 1)
+		fsck.nthreads = 1;
+
+	volume.dev = argv[optind];
+	volume.readonly = 1;
+	volume.fs = open(volume.dev, O_RDONLY);
+	if (volume.fs < 0)
+		err(1, "open(%s)", volume.dev);
+	if ((res = vfat_backend_open(&volume)) != 0)
+		errx(1, "%s: %s", volume.dev, strerror(-res));
+
+	fat_load(&volume); // Exits if the boot sector is invalid
+
+	fsck.max_cluster = fat_max_cluster(&volume);
+
+	fsck.used = calloc(fsck.max_cluster / 64 + 1, sizeof(uint64_t));
+	fsck.deques = calloc(fsck.nthreads, sizeof(*fsck.deques));
+	threads = calloc(fsck.nthreads, sizeof(*threads));
+	if (fsck.used == NULL || fsck.deques == NULL || threads == NULL)
+		err(1, "calloc");
+	for (i = 0; i < fsck.nthreads; ++i)
+		pthread_mutex_init(&fsck.deques[i].lock, NULL);
+
+	compare_fats();
+
+	// Links out of the volume anywhere in the FAT, even in chains no file uses
+	fat_scan(volume.fat_content, fsck.max_cluster, &scan);
+	if (scan.bad_links > 0)
+		report("%zu FAT entries link to clusters that don't exist",
+				scan.bad_links);
+
+	root = new_dir(NULL, "");
+	root->path[0] = '\0'; // So that children are "/name" and not "//name"
+	check_chain(&fsck.deques[0], volume.boot.fat32.root_cluster, 0, "/",
+			root);
+
+	for (i = 0; i < fsck.nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, worker_main, (void*) i) != 0)
+			err(1, "pthread_create");
+	}
+	for (i = 0; i < fsck.nthreads; ++i)
+		pthread_join(threads[i], NULL);
+
+	check_lost_clusters();
+
+	printf("%s: %zu files, %zu directories, %zu/%u clusters free, %zu errors\n",
+			volume.dev, fsck.files, fsck.directories, scan.free,
+			fsck.max_cluster - 1, fsck.errors);
+
+	while (fsck.dirs) {
+		struct fsck_dir *next = fsck.dirs->next;
+		free(fsck.dirs);
+		fsck.dirs = next;
+	}
+	for (i = 0; i < fsck.nthreads; ++i)
+		free(fsck.deques[i].items);
+	free(fsck.deques);
+	free(fsck.used);
+	free(threads);
+	free(volume.fat_content);
+	free(volume.fat_loaded);
+
+	return fsck.errors ? 1 : 0;
+}
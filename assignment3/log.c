@@ -0,0 +1,278 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Logging
+ *
+ * Messages go to a ring buffer owned by the thread that logs them, so logging
+ * never takes a lock nor does I/O on the request path. A background thread
+ * drains the rings to stderr, one logfmt line per message:
+ *
+ *   ts=1700000000.123456 level=debug thread=3 func=vfat_init msg="..."
+ *
+ * If a ring is full, messages are dropped and counted rather than blocking
+ * the logging thread. Before the flusher is started (and after it's stopped)
+ * messages are written directly.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "vfat.h"
+
+#define LOG_RING_SLOTS 256 // Has to be a power of 2
+#define LOG_MESSAGE_SIZE 200
+#define LOG_FLUSH_INTERVAL_MS 50
+
+struct log_record {
+	struct timespec ts;
+	int level;
+	const char *func; // Always a string literal (__func__)
+	char message[LOG_MESSAGE_SIZE];
+};
+
+/*
+ * Single producer (the owning thread), single consumer (the flusher).
+ * head and tail only ever grow, the slot of a record is its index modulo
+ * LOG_RING_SLOTS.
+ */
+struct log_ring {
+	unsigned int head; // Written by the owner
+	unsigned int tail; // Written by the flusher
+	unsigned int dropped; // Written by the owner
+	unsigned int dropped_reported; // Written by the flusher
+	int orphaned; // Set when the owner exits
+	unsigned int thread; // Small number identifying the owner in the output
+	struct log_ring *next;
+	struct log_record records[LOG_RING_SLOTS];
+};
+
+int vfat_log_level = VLOG_INFO;
+
+static const char *const level_names[] = {
+	[VLOG_ERROR] = "error",
+	[VLOG_WARN] = "warn",
+	[VLOG_INFO] = "info",
+	[VLOG_DEBUG] = "debug",
+	[VLOG_TRACE] = "trace",
+};
+
+static struct {
+	pthread_mutex_t lock; // Protects the list of rings and the flusher state
+	pthread_cond_t cond;
+	pthread_key_t key;
+	pthread_once_t once;
+	struct log_ring *rings;
+	unsigned int nr_threads;
+
+	pthread_t flusher;
+	int running;
+} logs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct log_ring *thread_ring;
+
+/*
+ * Parse a level given either by name or by number, -1 if it's invalid
+ */
+int vfat_log_parse_level(const char *s) {
+	char *end;
+	long n;
+	int level;
+
+	for (level = VLOG_ERROR; level <= VLOG_TRACE; ++level) {
+		if (strcasecmp(s, level_names[level]) == 0)
+			return level;
+	}
+
+	n = strtol(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || n < VLOG_ERROR || n > VLOG_TRACE)
+		return -1;
+	return n;
+}
+
+// Called when a thread that has a ring exits
+static void log_ring_orphan(void *arg) {
+	struct log_ring *ring = arg;
+
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_create(void) {
+	pthread_key_create(&logs.key, log_ring_orphan);
+}
+
+/*
+ * Ring of the calling thread, allocated by its first message
+ */
+static struct log_ring *log_thread_ring(void) {
+	struct log_ring *ring = thread_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	pthread_once(&logs.once, log_key_create);
+	pthread_setspecific(logs.key, ring);
+
+	pthread_mutex_lock(&logs.lock);
+	ring->thread = logs.nr_threads++;
+	ring->next = logs.rings;
+	logs.rings = ring;
+	pthread_mutex_unlock(&logs.lock);
+
+	thread_ring = ring;
+	return ring;
+}
+
+static void log_write(FILE *out, const struct log_record *r, unsigned int thread) {
+	const char *c;
+
+	fprintf(out, "ts=%lld.%06ld level=%s thread=%u func=%s msg=\"",
+			(long long) r->ts.tv_sec, r->ts.tv_nsec / 1000,
+			level_names[r->level], thread, r->func);
+	for (c = r->message; *c; ++c) {
+		if (*c == '"' || *c == '\\')
+			fputc('\\', out);
+		fputc(*c == '\n' ? ' ' : *c, out);
+	}
+	fputs("\"\n", out);
+}
+
+void vfat_log(int level, const char *func, const char *fmt, ...) {
+	struct log_record *r, direct;
+	struct log_ring *ring;
+	unsigned int head;
+	va_list ap;
+
+	if (!__atomic_load_n(&logs.running, __ATOMIC_ACQUIRE)) {
+		r = &direct; // Nobody would drain the ring
+		ring = NULL;
+	} else {
+		ring = log_thread_ring();
+		if (ring == NULL)
+			return;
+
+		head = ring->head;
+		if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+				== LOG_RING_SLOTS) {
+			++ring->dropped;
+			return;
+		}
+		r = &ring->records[head % LOG_RING_SLOTS];
+	}
+
+	clock_gettime(CLOCK_REALTIME, &r->ts);
+	r->level = level;
+	r->func = func;
+	va_start(ap, fmt);
+	vsnprintf(r->message, sizeof(r->message), fmt, ap);
+	va_end(ap);
+
+	if (ring == NULL) {
+		log_write(stderr, r, 0);
+		return;
+	}
+
+	// Publish the record
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write out everything that was logged so far. Must be called with the lock
+ * held, from a single consumer at a time.
+ */
+static void log_drain_locked(void) {
+	struct log_ring **link, *ring;
+
+	for (link = &logs.rings; (ring = *link);) {
+		int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+		unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned int tail = ring->tail;
+		unsigned int dropped;
+
+		for (; tail != head; ++tail)
+			log_write(stderr, &ring->records[tail % LOG_RING_SLOTS],
+					ring->thread);
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		// Only approximate: the owner may be counting at the same time
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported) {
+			fprintf(stderr, "level=warn thread=%u msg=\"dropped %u messages\"\n",
+					ring->thread, dropped - ring->dropped_reported);
+			ring->dropped_reported = dropped;
+		}
+
+		if (orphaned) {
+			*link = ring->next;
+			free(ring);
+		} else {
+			link = &ring->next;
+		}
+	}
+	fflush(stderr);
+}
+
+static void *log_flusher_main(void *arg) {
+	pthread_mutex_lock(&logs.lock);
+	while (logs.running) {
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+		pthread_cond_timedwait(&logs.cond, &logs.lock, &deadline);
+
+		log_drain_locked();
+	}
+	pthread_mutex_unlock(&logs.lock);
+	return NULL;
+}
+
+/*
+ * Start the flusher. Has to be called from the FUSE init callback since
+ * fuse_main() forks when going to the background.
+ */
+void vfat_log_start(void) {
+	pthread_mutex_lock(&logs.lock);
+	__atomic_store_n(&logs.running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&logs.flusher, NULL, log_flusher_main, NULL) != 0)
+		__atomic_store_n(&logs.running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&logs.lock);
+}
+
+/*
+ * Stop the flusher and write what's left in the rings
+ */
+void vfat_log_stop(void) {
+	int running;
+
+	pthread_mutex_lock(&logs.lock);
+	running = logs.running;
+	__atomic_store_n(&logs.running, 0, __ATOMIC_RELEASE);
+	pthread_cond_signal(&logs.cond);
+	pthread_mutex_unlock(&logs.lock);
+
+	if (running)
+		pthread_join(logs.flusher, NULL);
+
+	// Threads that raced with the stop may still publish, they're lost then
+	pthread_mutex_lock(&logs.lock);
+	log_drain_locked();
+	pthread_mutex_unlock(&logs.lock);
+}
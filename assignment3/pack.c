@@ -0,0 +1,145 @@
+// vim: noet:ts=8:sts=8
+/*
+ * vfat_pack: compress an image so that it can be mounted without being
+ * decompressed first (see struct vfat_pack_header)
+ *
+ *   vfat_pack <image> <packed image> [chunk size in KiB, 64 by default]
+ *
+ * Smaller chunks make random reads cheaper, bigger ones compress better.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "vfat.h"
+
+#define DEFAULT_CHUNK_KIB 64
+
+static void write_full(int fd, const void *buf, size_t len, off_t off) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			err(1, "write");
+		buf = (const uint8_t*) buf + n;
+		len -= n;
+		off += n;
+	}
+}
+
+static size_t read_full(int fd, void *buf, size_t len, off_t off) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, (uint8_t*) buf + done, len - done, off + done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(1, "read");
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static int all_zero(const uint8_t *buf, size_t len) {
+	return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+int main(int argc, char **argv) {
+	struct vfat_pack_header header;
+	uint8_t *in, *out;
+	uint64_t *index, chunk;
+	off_t size, pos;
+	uLong bound;
+	unsigned long chunk_kib = DEFAULT_CHUNK_KIB;
+	int src, dst;
+
+	if (argc < 3 || argc > 4)
+		errx(2, "usage: %s <image> <packed image> [chunk size in KiB]", argv[0]);
+	if (argc == 4) {
+		char *end;
+
+		chunk_kib = strtoul(argv[3], &end, 10);
+		if (*end != '\0' || chunk_kib < 4 || chunk_kib > 4096
+				|| (chunk_kib & (chunk_kib - 1)) != 0)
+			errx(2, "the chunk size has to be a power of 2 between 4 and 4096 KiB");
+	}
+
+	src = open(argv[1], O_RDONLY);
+	if (src < 0)
+		err(1, "open(%s)", argv[1]);
+	size = lseek(src, 0, SEEK_END);
+	if (size < 0)
+		err(1, "lseek(%s)", argv[1]);
+	dst = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dst < 0)
+		err(1, "open(%s)", argv[2]);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VFAT_PACK_MAGIC, sizeof(header.magic));
+	header.version = VFAT_PACK_VERSION;
+	header.chunk_size = chunk_kib * 1024;
+	header.device_size = size;
+	header.nr_chunks = (size + header.chunk_size - 1) / header.chunk_size;
+
+	bound = compressBound(header.chunk_size);
+	in = malloc(header.chunk_size);
+	out = malloc(bound);
+	index = malloc((header.nr_chunks + 1) * sizeof(*index));
+	if (in == NULL || out == NULL || index == NULL)
+		errx(1, "out of memory");
+
+	pos = sizeof(header);
+	for (chunk = 0; chunk < header.nr_chunks; ++chunk) {
+		size_t len = read_full(src, in, header.chunk_size,
+				chunk * header.chunk_size);
+		uLongf out_len = bound;
+
+		if (len != header.chunk_size && chunk + 1 < header.nr_chunks)
+			errx(1, "%s: short read", argv[1]);
+
+		index[chunk] = pos;
+		if (all_zero(in, len))
+			continue; // Empty chunk
+
+		// Store the chunk as is if it doesn't compress
+		if (compress2(out, &out_len, in, len, Z_BEST_COMPRESSION) != Z_OK
+				|| out_len >= len) {
+			write_full(dst, in, len, pos);
+			pos += len;
+		} else {
+			write_full(dst, out, out_len, pos);
+			pos += out_len;
+		}
+	}
+	index[header.nr_chunks] = pos;
+
+	header.index_offset = pos;
+	write_full(dst, index, (header.nr_chunks + 1) * sizeof(*index), pos);
+	write_full(dst, &header, sizeof(header), 0);
+	if (fsync(dst) != 0 || close(dst) != 0)
+		err(1, "%s", argv[2]);
+
+	printf("%s: %lld bytes in %llu chunks of %u bytes, packed to %lld bytes\n",
+			argv[2], (long long) size, (unsigned long long) header.nr_chunks,
+			header.chunk_size, (long long) (pos
+					+ (header.nr_chunks + 1) * sizeof(*index)));
+
+	free(in);
+	free(out);
+	free(index);
+	close(src);
+	return 0;
+}
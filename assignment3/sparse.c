@@ -0,0 +1,236 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Holes of sparse images
+ *
+ * Freshly created images are mostly holes. Reading them only gives zeroes, so
+ * clusters that lie in a hole are zero-filled in memory instead of being read.
+ * The holes of a volume are found with SEEK_DATA/SEEK_HOLE: on demand until the
+ * background loader has mapped the whole image (sparse_scan()), then from that
+ * map. Writing to the device drops the map, the holes are queried again.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+enum sparse_state {
+	SPARSE_QUERY, // Ask the file system for every region
+	SPARSE_MAPPED, // Use the holes array
+	SPARSE_NONE, // The device can't tell, it's all data
+};
+
+struct sparse_hole {
+	off_t start;
+	off_t end;
+};
+
+struct vfat_sparse {
+	pthread_rwlock_t lock;
+	enum sparse_state state;
+	unsigned int generation; // Bumped by every write, makes stale scans fail
+	struct sparse_hole *holes; // Sorted, only valid in SPARSE_MAPPED
+	size_t nr_holes;
+};
+
+void sparse_init(struct vfat_data *vol) {
+	struct vfat_sparse *sp = calloc(1, sizeof(*sp));
+	struct stat st;
+
+	if (sp == NULL)
+		err(1, "calloc");
+	pthread_rwlock_init(&sp->lock, NULL);
+
+	// Block devices don't have holes, compressed images are read by chunks
+	if (!vol->backend.ops->direct || fstat(vol->fs, &st) != 0
+			|| !S_ISREG(st.st_mode))
+		sp->state = SPARSE_NONE;
+	vol->sparse = sp;
+}
+
+/*
+ * Region of the device containing pos, asking the file system.
+ * Returns whether it's a hole, its end is stored in end.
+ */
+static int sparse_query(struct vfat_data *vol, off_t pos, off_t *end) {
+	off_t data, hole;
+	struct stat st;
+
+	stats_add(STAT_SYSCALLS, 1);
+	data = lseek(vol->fs, pos, SEEK_DATA);
+	if (data < 0 && errno == ENXIO) {
+		// No data after pos, the hole goes to the end of the image
+		if (fstat(vol->fs, &st) == 0 && pos < st.st_size) {
+			*end = st.st_size;
+			return 1;
+		}
+	}
+	if (data < 0) {
+		*end = INT64_MAX; // Unsupported or past the end, let the reads tell
+		return 0;
+	}
+	if (data > pos) {
+		*end = data;
+		return 1;
+	}
+
+	stats_add(STAT_SYSCALLS, 1);
+	hole = lseek(vol->fs, pos, SEEK_HOLE);
+	*end = hole > pos ? hole : INT64_MAX;
+	return 0;
+}
+
+/*
+ * Same as sparse_query() from the holes array. Must be called with the lock held.
+ */
+static int sparse_lookup(struct vfat_sparse *sp, off_t pos, off_t *end) {
+	size_t low = 0, high = sp->nr_holes;
+
+	// First hole ending after pos
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (sp->holes[mid].end <= pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == sp->nr_holes) {
+		*end = INT64_MAX;
+		return 0;
+	}
+	if (sp->holes[low].start <= pos) {
+		*end = sp->holes[low].end;
+		return 1;
+	}
+	*end = sp->holes[low].start;
+	return 0;
+}
+
+/*
+ * Whether the len bytes at pos of the device are all in a hole. The region found
+ * is kept in cur, so walking a file only looks up each region once.
+ */
+int sparse_is_hole(struct vfat_data *vol, struct sparse_cursor *cur, off_t pos,
+		size_t len) {
+	struct vfat_sparse *sp = vol->sparse;
+	enum sparse_state state;
+
+	if (pos < cur->start || pos >= cur->end) {
+		pthread_rwlock_rdlock(&sp->lock);
+		state = sp->state;
+		if (state == SPARSE_MAPPED)
+			cur->hole = sparse_lookup(sp, pos, &cur->end);
+		pthread_rwlock_unlock(&sp->lock);
+
+		if (state == SPARSE_QUERY)
+			cur->hole = sparse_query(vol, pos, &cur->end);
+		else if (state == SPARSE_NONE) {
+			cur->hole = 0;
+			cur->end = INT64_MAX;
+		}
+		cur->start = pos;
+	}
+
+	// A cluster that is only partly in a hole has to be read
+	return cur->hole && pos + (off_t) len <= cur->end;
+}
+
+/*
+ * Map the holes of the whole image, so that reads stop asking the file system
+ */
+void sparse_scan(struct vfat_data *vol) {
+	struct vfat_sparse *sp = vol->sparse;
+	struct sparse_hole *holes = NULL;
+	size_t nr_holes = 0, capacity = 0;
+	unsigned int generation;
+	int installed = 0;
+	struct stat st;
+	off_t pos = 0;
+
+	pthread_rwlock_rdlock(&sp->lock);
+	generation = sp->generation;
+	if (sp->state != SPARSE_QUERY || fstat(vol->fs, &st) != 0) {
+		pthread_rwlock_unlock(&sp->lock);
+		return;
+	}
+	pthread_rwlock_unlock(&sp->lock);
+
+	while (pos < st.st_size) {
+		off_t data = lseek(vol->fs, pos, SEEK_DATA);
+		off_t hole;
+
+		if (data < 0 && errno != ENXIO) {
+			free(holes);
+			vlog(VLOG_DEBUG, "%s: can't find the holes", vol->dev);
+			return;
+		}
+		if (data < 0 || data > st.st_size)
+			data = st.st_size;
+
+		if (data > pos) {
+			if (nr_holes == capacity) {
+				struct sparse_hole *grown;
+
+				capacity = capacity ? capacity * 2 : 16;
+				grown = realloc(holes, capacity * sizeof(*grown));
+				if (grown == NULL) {
+					free(holes);
+					return;
+				}
+				holes = grown;
+			}
+			holes[nr_holes].start = pos;
+			holes[nr_holes].end = data;
+			++nr_holes;
+		}
+		if (data == st.st_size)
+			break;
+
+		hole = lseek(vol->fs, data, SEEK_HOLE);
+		if (hole <= data)
+			break; // Treat the rest as data
+		pos = hole;
+	}
+
+	pthread_rwlock_wrlock(&sp->lock);
+	if (sp->state == SPARSE_QUERY && sp->generation == generation) {
+		sp->holes = holes;
+		sp->nr_holes = nr_holes;
+		sp->state = SPARSE_MAPPED;
+		installed = 1;
+	}
+	pthread_rwlock_unlock(&sp->lock);
+
+	if (installed)
+		vlog(VLOG_DEBUG, "%s: %zu holes", vol->dev, nr_holes);
+	else
+		free(holes); // A write raced with the scan
+}
+
+/*
+ * Has to be called when len bytes at pos of the device are written, they may
+ * have filled a hole
+ */
+void sparse_written(struct vfat_data *vol, off_t pos, size_t len) {
+	struct vfat_sparse *sp = vol->sparse;
+	off_t end;
+
+	pthread_rwlock_wrlock(&sp->lock);
+	++sp->generation;
+	if (sp->state == SPARSE_MAPPED
+			&& (sparse_lookup(sp, pos, &end) || end < pos + (off_t) len)) {
+		free(sp->holes);
+		sp->holes = NULL;
+		sp->nr_holes = 0;
+		sp->state = SPARSE_QUERY;
+	}
+	pthread_rwlock_unlock(&sp->lock);
+}
@@ -0,0 +1,318 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Internal counters
+ *
+ * Every thread counts in its own block, so the hot paths never share a cache
+ * line nor take a lock. The blocks are only summed when somebody looks at them:
+ * reading /.vfat_stats in the mounted tree, or sending SIGUSR1 to the process
+ * (the stats are then written to stderr).
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define STATS_BUCKETS 64 // Bucket i counts latencies in [2^i, 2^(i+1)) ns
+
+struct thread_stats {
+	uint64_t counters[NR_STATS];
+	uint64_t ops[NR_OPS];
+	uint64_t op_ns[NR_OPS]; // Total latency
+	uint64_t latency[NR_OPS][STATS_BUCKETS];
+	struct thread_stats *next;
+};
+
+static const char *const op_names[NR_OPS] = {
+	[OP_LOOKUP] = "lookup",
+	[OP_FORGET] = "forget",
+	[OP_GETATTR] = "getattr",
+	[OP_OPENDIR] = "opendir",
+	[OP_READDIR] = "readdir",
+	[OP_OPEN] = "open",
+	[OP_READ] = "read",
+	[OP_FLUSH] = "flush",
+	[OP_FSYNC] = "fsync",
+	[OP_RELEASE] = "release",
+	[OP_STATFS] = "statfs",
+};
+
+static const char *const stat_names[NR_STATS] = {
+	[STAT_DENTRY_HIT] = "dentry_cache_hits",
+	[STAT_DENTRY_MISS] = "dentry_cache_misses",
+	[STAT_INODE_HIT] = "inode_cache_hits",
+	[STAT_INODE_MISS] = "inode_cache_misses",
+	[STAT_WB_DIR_HIT] = "wb_dir_hits",
+	[STAT_WB_DIR_MISS] = "wb_dir_misses",
+	[STAT_WB_DATA_HIT] = "wb_data_hits",
+	[STAT_WB_DATA_MISS] = "wb_data_misses",
+	[STAT_BYTES_READ] = "device_bytes_read",
+	[STAT_BYTES_WRITTEN] = "device_bytes_written",
+	[STAT_SYSCALLS] = "device_syscalls",
+	[STAT_EXTENTS_MERGED] = "extents_merged",
+	[STAT_HOLE_BYTES] = "hole_bytes_zero_filled",
+};
+
+static struct {
+	pthread_mutex_t lock; // Protects the list and the counts of exited threads
+	pthread_key_t key;
+	pthread_once_t once;
+	struct thread_stats *threads;
+	struct thread_stats exited;
+
+	int pipe[2]; // Written by the SIGUSR1 handler
+	pthread_t dumper;
+	int running;
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+	.pipe = { -1, -1 },
+};
+
+static __thread struct thread_stats *thread_stats;
+
+/*
+ * Fold the counts of an exiting thread in stats.exited. Runs in the exiting
+ * thread, so nobody writes to its counters anymore.
+ */
+static void stats_thread_exit(void *arg) {
+	struct thread_stats *ts = arg, **link;
+	size_t i, j;
+
+	pthread_mutex_lock(&stats.lock);
+	for (link = &stats.threads; *link != ts; link = &(*link)->next)
+		;
+	*link = ts->next;
+
+	for (i = 0; i < NR_STATS; ++i)
+		stats.exited.counters[i] += ts->counters[i];
+	for (i = 0; i < NR_OPS; ++i) {
+		stats.exited.ops[i] += ts->ops[i];
+		stats.exited.op_ns[i] += ts->op_ns[i];
+		for (j = 0; j < STATS_BUCKETS; ++j)
+			stats.exited.latency[i][j] += ts->latency[i][j];
+	}
+	pthread_mutex_unlock(&stats.lock);
+
+	free(ts);
+}
+
+static void stats_key_create(void) {
+	pthread_key_create(&stats.key, stats_thread_exit);
+}
+
+static struct thread_stats *stats_thread(void) {
+	struct thread_stats *ts = thread_stats;
+
+	if (ts)
+		return ts;
+
+	ts = calloc(1, sizeof(*ts));
+	if (ts == NULL)
+		return NULL;
+
+	pthread_once(&stats.once, stats_key_create);
+	pthread_setspecific(stats.key, ts);
+
+	pthread_mutex_lock(&stats.lock);
+	ts->next = stats.threads;
+	stats.threads = ts;
+	pthread_mutex_unlock(&stats.lock);
+
+	thread_stats = ts;
+	return ts;
+}
+
+// Only the owner writes, the atomic store keeps readers from seeing torn values
+static inline void stats_inc(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void stats_add(enum vfat_stat stat, uint64_t n) {
+	struct thread_stats *ts = stats_thread();
+
+	if (ts)
+		stats_inc(&ts->counters[stat], n);
+}
+
+uint64_t stats_op_begin(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_op_end(enum vfat_op op, uint64_t start) {
+	struct thread_stats *ts = stats_thread();
+	uint64_t ns = stats_op_begin() - start;
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if (ts == NULL)
+		return;
+	stats_inc(&ts->ops[op], 1);
+	stats_inc(&ts->op_ns[op], ns);
+	stats_inc(&ts->latency[op][bucket], 1);
+}
+
+/*
+ * Sum the blocks of all the threads
+ */
+static void stats_sum(struct thread_stats *sum) {
+	struct thread_stats *ts;
+	size_t i, j;
+
+	pthread_mutex_lock(&stats.lock);
+	*sum = stats.exited;
+	for (ts = stats.threads; ts; ts = ts->next) {
+		for (i = 0; i < NR_STATS; ++i)
+			sum->counters[i] += __atomic_load_n(&ts->counters[i],
+					__ATOMIC_RELAXED);
+		for (i = 0; i < NR_OPS; ++i) {
+			sum->ops[i] += __atomic_load_n(&ts->ops[i], __ATOMIC_RELAXED);
+			sum->op_ns[i] += __atomic_load_n(&ts->op_ns[i], __ATOMIC_RELAXED);
+			for (j = 0; j < STATS_BUCKETS; ++j)
+				sum->latency[i][j] += __atomic_load_n(&ts->latency[i][j],
+						__ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/*
+ * One "name value" pair per line, then one line per operation:
+ *   op.<name> count=<n> avg_ns=<n> hist=<bucket start in ns>:<count>,...
+ */
+static void stats_print(FILE *out) {
+	struct thread_stats *sum = malloc(sizeof(*sum));
+	size_t i, j;
+
+	if (sum == NULL)
+		return;
+	stats_sum(sum);
+
+	for (i = 0; i < NR_STATS; ++i)
+		fprintf(out, "%s %llu\n", stat_names[i],
+				(unsigned long long) sum->counters[i]);
+
+	for (i = 0; i < NR_OPS; ++i) {
+		const char *sep = "";
+
+		fprintf(out, "op.%s count=%llu avg_ns=%llu hist=", op_names[i],
+				(unsigned long long) sum->ops[i],
+				(unsigned long long) (sum->ops[i] ?
+						sum->op_ns[i] / sum->ops[i] : 0));
+		for (j = 0; j < STATS_BUCKETS; ++j) {
+			if (sum->latency[i][j] == 0)
+				continue;
+			fprintf(out, "%s%llu:%llu", sep, 1ull << j,
+					(unsigned long long) sum->latency[i][j]);
+			sep = ",";
+		}
+		fputc('\n', out);
+	}
+
+	free(sum);
+}
+
+/*
+ * Current stats, as the content of the stats file. Free with free().
+ */
+struct stats_snapshot *stats_snapshot(void) {
+	struct stats_snapshot *snap;
+	char *text;
+	size_t size;
+	FILE *out;
+
+	out = open_memstream(&text, &size);
+	if (out == NULL)
+		return NULL;
+	stats_print(out);
+	if (fclose(out) != 0)
+		return NULL;
+
+	snap = malloc(sizeof(*snap) + size);
+	if (snap) {
+		snap->size = size;
+		memcpy(snap->data, text, size);
+	}
+	free(text);
+	return snap;
+}
+
+/*
+ * Attributes of the stats file. Its size is unknown until it's opened, so it's
+ * opened in direct I/O mode and reported as empty.
+ */
+void stats_fill_stat(struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+	st->st_nlink = 1;
+	st->st_uid = mount_uid;
+	st->st_gid = mount_gid;
+	st->st_mtime = st->st_ctime = time(NULL);
+}
+
+static void stats_sigusr1(int sig) {
+	int saved_errno = errno;
+	char c = 0;
+
+	if (write(stats.pipe[1], &c, 1) < 0)
+		; // The pipe is full, a dump is already pending
+	errno = saved_errno;
+}
+
+static void *stats_dumper_main(void *arg) {
+	char c;
+
+	// Ends when stats_stop() closes the write end
+	while (read(stats.pipe[0], &c, 1) == 1) {
+		stats_print(stderr);
+		fflush(stderr);
+	}
+	return NULL;
+}
+
+/*
+ * Dump the stats to stderr on SIGUSR1. Has to be called from the FUSE init
+ * callback since fuse_main() forks when going to the background.
+ */
+void stats_start(void) {
+	struct sigaction sa;
+
+	if (pipe(stats.pipe) != 0)
+		return;
+	fcntl(stats.pipe[1], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&stats.dumper, NULL, stats_dumper_main, NULL) != 0) {
+		close(stats.pipe[0]);
+		close(stats.pipe[1]);
+		return;
+	}
+	stats.running = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_sigusr1;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+void stats_stop(void) {
+	if (!stats.running)
+		return;
+
+	signal(SIGUSR1, SIG_DFL);
+	close(stats.pipe[1]);
+	pthread_join(stats.dumper, NULL);
+	close(stats.pipe[0]);
+	stats.running = 0;
+}
@@ -1,586 +1,566 @@
-// vim: noet:ts=8:sts=8
-#define FUSE_USE_VERSION 26
-#define _GNU_SOURCE
-
-#include <sys/mman.h>
-#include <assert.h>
-#include <err.h>
-#include <errno.h>
-#include <fcntl.h>  
-#include <iconv.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-
-#ifdef __APPLE__
-#include <osxfuse/fuse.h>
-#include <machine/endian.h>
-#else
-#include <fuse.h>
-#include <endian.h>
-#endif
-
-#include "vfat.h"
-
-#define DEBUG_PRINT //
-#define DIRECTORY_RECORD_SIZE 32
-#define MIN_NB_OF_SECTORS 65525
-#define MAX_CLUSTER_SIZE 32768
-
-// A kitchen sink for all important data about filesystem
-struct vfat_data {
-	const char *dev;
-	int fs;
-	struct fat_boot boot;
-
-	size_t fat_begin; // offset of the FAT (in sectors)
-	size_t clusters_begin; // offset of the clusters (in sectors)
-	size_t fat_size; // size of FAT (in bytes)
-	size_t clusters_size; // size of a cluster (in bytes)
-
-	uint32_t* fat_content;
-};
-
-struct vfat_direntry {
-	uint32_t first_cluster;
-
-};
-
-struct vfat_data vfat_info = { 0 };
-iconv_t iconv_utf16;
-
-uid_t mount_uid;
-gid_t mount_gid;
-time_t mount_time;
-
-/*
- * Print the content in hexadecimal form for debugging
- */
-static void hex_print(const void* content, size_t size) {
-	if (content) {
-		size_t offset;
-
-		for (offset = 0; offset < size; ++offset) {
-			if (offset % 16 == 0 && offset != 0)
-				puts("");
-			printf("%02X ", ((uint8_t*) content)[offset]);
-		}
-		printf("\n");
-	}
-}
-
-/*
- * Follows a chain in the FAT starting at the specified offset.
- * Also calls the callback function for each entry.
- * The size argument is used when reading files. Should be 0 for directories.
- *
- * The arguments of the callback function are :
- * - The cluster to read
- * - How many bytes to read from that cluster
- */
-static void follow_fat_chain(size_t offset,
-		void (*callback)(size_t cluster_number, size_t n), size_t size) {
-	if (vfat_info.fat_content && callback) {
-		uint32_t entry;
-
-		do {
-			entry = vfat_info.fat_content[offset] & 0xFFFFFFF; // Mask the 4 upper bits
-			printf("Callback for cluster #%zu (next is #%zu)\n", offset, entry);
-
-			size_t to_read =
-					size < vfat_info.clusters_size ?
-							size : vfat_info.clusters_size;
-			callback(offset, to_read);
-			size -= vfat_info.clusters_size;
-
-			offset = entry;
-		} while (offset < 0xFFFFFF8); // Any value greater or equal to 0xFFFFFF8 means end of chain
-	}
-}
-
-/*
- * Helper function to convert a number of sectors to a number of bytes
- */
-static inline size_t sectors_to_bytes(size_t number_of_sectors) {
-	return number_of_sectors * vfat_info.boot.bytes_per_sector;
-}
-
-/*
- * Helper function to convert a cluster number to a byte offset
- */
-static inline size_t cluster_to_bytes(size_t cluster_number) {
-	return vfat_info.clusters_begin
-			+ (cluster_number - 2) * vfat_info.clusters_size; // The first data cluster is cluster #2
-}
-
-/*
- * Read one cluster to the specified buffer
- */
-static void read_cluster(void* buffer, size_t cluster_number) {
-	if (buffer) { // TODO : Add check for sector alignment ?
-		lseek(vfat_info.fs, cluster_to_bytes(cluster_number), SEEK_SET);
-		read(vfat_info.fs, buffer, vfat_info.clusters_size);
-	}
-}
-
-/*
- * Remove spaces from a filename (name + extension)
- * The output array has to be able to contain at least 12 characters
- */
-static void trim_filename(char* output, char* nameext) {
-	if (output && nameext) {
-
-		size_t i;
-		size_t out_offset = 0;
-
-		for (i = 0; i < 11; ++i) { // Short names are always 11 characters long
-			if (nameext[i] != 0x20) { // The character is not a space
-				output[out_offset++] = nameext[i];
-			}
-		}
-
-		output[out_offset] = '\0';
-	}
-}
-
-/*
- * Read the directory entries located at the specified cluster number
- * The n argument is ignored. It's used when reading files but we keep it to have the same signature.
- */
-static void read_directory_cluster(size_t cluster_number, size_t n) {
-	uint8_t cluster[vfat_info.clusters_size];
-	read_cluster(cluster, cluster_number);
-
-	size_t offset = 0;
-	struct fat32_direntry entry;
-	do {
-
-		// If the first byte is 0xE5, the directory is unused
-		if (cluster[offset] != 0xE5) {
-			memcpy(&entry, &cluster[offset], sizeof(entry));
-
-			// If it's a long file name, we're ignoring it (for now)
-			if ((entry.attr & VFAT_ATTR_LFN) != VFAT_ATTR_LFN) {
-				if (entry.attr & VFAT_ATTR_DIR) {
-					printf("[D] ");
-				} else if (entry.attr & VFAT_ATTR_VOLUME_ID) {
-					printf("[V] ");
-				} else if (entry.attr & VFAT_ATTR_INVAL) {
-					printf("[I] ");
-				} else {
-					printf("[F] ");
-				}
-
-				char name[12]; // We need one more byte to add the \0 character so that it's a valid C string
-				trim_filename(name, entry.nameext);
-
-				uint32_t cluster_location = entry.cluster_hi << 16
-						| entry.cluster_lo;
-				printf("%-11s - %u Bytes (First cluster = %u, offset = %08X)\n",
-						name, entry.size, cluster_location,
-						cluster_to_bytes(cluster_location));
-			}
-
-			//hex_print(&cluster[offset], DIRECTORY_RECORD_SIZE);
-		}
-
-		offset += DIRECTORY_RECORD_SIZE;
-	} while (cluster[offset] != 0); // If the first byte is 0x00, end of directory
-}
-
-/*
- * Helper function to read the whole directory starting at cluster number
- */
-static inline void read_directory(size_t cluster_number) {
-	follow_fat_chain(cluster_number, read_directory_cluster, 0);
-}
-
-/*
- * Read the first n bytes of the specified cluster.
- */
-static void read_file_cluster(size_t cluster_number, size_t n) {
-	assert(n <= vfat_info.clusters_size);
-
-	uint8_t cluster[vfat_info.clusters_size];
-	read_cluster(cluster, cluster_number);
-
-	hex_print(cluster, n);
-}
-
-/*
- * Read the file
- */
-static void read_file(size_t cluster_number, size_t size) {
-	assert(size > 0);
-
-	follow_fat_chain(cluster_number, read_file_cluster, size);
-}
-
-/*
- * Checks the Volume ID and make sure it's a FAT32 partition
- * Be careful since this function ends the program if the boot sector is invalid
- */
-static void check_boot_validity(const struct fat_boot* data) {
-
-	switch (data->bytes_per_sector) {
-	case 512:
-	case 1024:
-	case 2048:
-	case 4096:
-		break; // Valid value
-	default:
-		errx(1, "Invalid number of bytes per sector. Exiting...");
-	}
-
-	switch (data->sectors_per_cluster) {
-	case 1:
-	case 2:
-	case 4:
-	case 8:
-	case 16:
-	case 32:
-	case 64:
-	case 128:
-		break; // Valid value
-	default:
-		errx(1, "Invalid number of sectors per cluster. Exiting...");
-	}
-
-	if (sectors_to_bytes(data->sectors_per_cluster) >= MAX_CLUSTER_SIZE) {
-		errx(1, "Invalid cluster size. Exiting...");
-	}
-
-	// Checking various fields of the boot sector
-	if (data->fat_count != 2 || data->root_max_entries != 0
-			|| data->total_sectors_small != 0
-			|| data->sectors_per_fat_small != 0 || data->fat32.version != 0
-			|| data->fat32.signature != 0xAA55) {
-		errx(1, "Invalid FAT32 boot sector. Exiting...");
-	}
-
-	// Make sure the reserved space of the boot sector is empty (as it should be for a valid FAT32 partition)
-	size_t offset;
-	for (offset = 0; offset < sizeof(data->fat32.reserved2); ++offset) {
-		if (data->fat32.reserved2[offset] != 0) {
-			errx(1, "Reserved space of boot sector is not zero. Exiting...");
-		}
-	}
-
-	// Checking if the number of clusters is valid
-	unsigned long dataSec = data->total_sectors
-			- (data->reserved_sectors
-					+ (data->fat32.sectors_per_fat * data->fat_count));
-	unsigned long count_clusters = dataSec / data->sectors_per_cluster;
-
-	if (count_clusters < MIN_NB_OF_SECTORS) {
-		errx(1, "Invalid number of sectors for FAT32. Exiting...");
-	}
-}
-
-/*
- * Free ressources
- */
-static void cleanup(void) {
-	free(vfat_info.fat_content);
-}
-
-static void vfat_init(const char *dev) {
-	iconv_utf16 = iconv_open("utf-8", "utf-16"); // from utf-16 to utf-8
-	// These are useful so that we can setup correct permissions in the mounted directories
-	mount_uid = getuid();
-	mount_gid = getgid();
-
-	// Use mount time as mtime and ctime for the filesystem root entry (e.g. "/")
-	mount_time = time(NULL);
-
-	vfat_info.fs = open(dev, O_RDONLY);
-	if (vfat_info.fs < 0)
-		err(1, "open(%s)", dev);
-
-	// Read the boot sector
-	read(vfat_info.fs, &vfat_info.boot, sizeof(vfat_info.boot));
-	check_boot_validity(&vfat_info.boot);
-
-	// Compute some useful values
-	vfat_info.fat_begin = sectors_to_bytes(vfat_info.boot.reserved_sectors);
-	vfat_info.fat_size = sectors_to_bytes(vfat_info.boot.fat32.sectors_per_fat);
-	vfat_info.clusters_begin = sectors_to_bytes(
-			vfat_info.boot.reserved_sectors
-					+ vfat_info.boot.fat32.sectors_per_fat
-							* vfat_info.boot.fat_count);
-	vfat_info.clusters_size = sectors_to_bytes(
-			vfat_info.boot.sectors_per_cluster);
-
-	// Read the FAT
-	vfat_info.fat_content = calloc(vfat_info.fat_size, sizeof(uint32_t));
-	if (vfat_info.fat_content == NULL) {
-		errx(1, "Could't read the FAT. Exiting...");
-	}
-
-	lseek(vfat_info.fs, vfat_info.fat_begin, SEEK_SET);
-	read(vfat_info.fs, vfat_info.fat_content, vfat_info.fat_size);
-
-	// Print the FAT for debugging matters
-	//hex_print(vfat_info.fat_content, vfat_info.fat_size);
-
-	puts("=============================");
-	puts(" Reading the root directory ");
-	puts("=============================");
-	//read_directory(vfat_info.boot.fat32.root_cluster);
-
-	puts("Reading a file...");
-	//read_file(783, 458759);
-	//read_file(259, 10);
-
-	// Free Willy !
-	//cleanup();
-}
-
-/* XXX add your code here */
-
-static int
-
-vfat_readdir(struct vfat_direntry *e, fuse_fill_dir_t filler, void *fillerdata) {
-	struct stat st; // we can reuse same stat entry over and over again
-	void *buf = NULL;
-	char name[12];
-	struct fat32_direntry entry;
-	//int max_len_name = VFAT_MAXFILE_NAME;
-	//char name[max_len_name];
-	uint8_t cluster[vfat_info.clusters_size];
-	//memset(name, '\0', max_len_name);
-	memset(&st, 0, sizeof(st));
-	st.st_uid = mount_uid;
-	st.st_gid = mount_gid;
-	st.st_nlink = 1;
-	st.st_rdev = 0;
-	st.st_size =0;
-	st.st_blocks=1;
-	st.st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFREG;
-	buf = fillerdata;
-
-	read_cluster(cluster, e->first_cluster);
-
-	unsigned int offset = 0;
-	unsigned int next_offset = 0;
-
-	do {
-		memset(name, '\0', 12);
-
-		next_offset += DIRECTORY_RECORD_SIZE;
-
-		// If the first byte is 0xE5, the directory is unused
-		if (cluster[offset] != 0xE5) {
-			memcpy(&entry, &cluster[offset], sizeof(entry));
-
-			// If it's a long file name, we're ignoring it (for now)
-			if ((entry.attr & VFAT_ATTR_LFN) != VFAT_ATTR_LFN) {
-				if (entry.attr & VFAT_ATTR_DIR) {
-					st.st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
-					printf("[D] ");
-				} else if (entry.attr & VFAT_ATTR_VOLUME_ID) {
-					printf("[V] ");
-				} else if (entry.attr & VFAT_ATTR_INVAL) {
-					printf("[I] ");
-				} else {
-					printf("[F] ");
-					st.st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFREG;
-				}
-				st.st_rdev = 0;
-				st.st_size = 30;
-				st.st_blocks=1;
-				// FIx me .. allocation of  name with MAXNAMELENGTH
-				// We need one more byte to add the \0 character so that it's a valid C string
-				trim_filename(name, entry.nameext);
-
-				e->first_cluster = entry.cluster_hi << 16 | entry.cluster_lo;
-				printf("%-11s - %u Bytes (First cluster = %u, offset = %08X)\n",
-						name, entry.size, e->first_cluster, offset);
-
-				filler(buf, name, &st, 0);
-
-			}
-
-			//hex_print(&cluster[offset], DIRECTORY_RECORD_SIZE);
-		}
-
-		offset += DIRECTORY_RECORD_SIZE;
-
-	} while (cluster[offset] != 0); // If the first byte is 0x00, end of directory
-	return cluster[offset];
-}
-
-// Used by vfat_search_entry()
-struct vfat_search_data {
-	const char *name;
-	int found;
-	struct stat *st;
-
-};
-
-// You can use this in vfat_resolve as a filler function for vfat_readdir
-static int vfat_search_entry(void *data, const char *name,
-		const struct stat *st, off_t offs) {
-	struct vfat_search_data *sd = data;
-
-	if (strcmp(sd->name, name) != 0)
-		return (0);
-
-	sd->found = 1;
-
-	*sd->st = *st;
-
-	return (1);
-}
-
-// Recursively find correct file/directory node given the path
-static int vfat_resolve(const char *path, struct stat *st,
-		struct vfat_direntry *e) {
-	struct vfat_search_data sd;
-
-	char *path_v;
-	char ch[2] = "/";
-	char *name;
-	int length;
-	int size;
-	char *next;
-	size = strlen(path) + 1;
-	path_v = malloc(sizeof(char) * size);
-	memset(path_v, '\0', size);
-	strcpy(path_v, path);
-
-	path_v = path_v + strspn(path_v, ch); //for leading "/";
-
-	name = strchr(path_v, ch);
-	length = size - 1;
-	if (name != 0) {
-		length = name - path_v;
-	}
-
-	name = malloc(sizeof(char) * (length + 1));
-	memset(name, '\0', length + 1);
-	memcpy(name, path_v, length);
-	sd.st= st;
-	sd.name = name;
-	sd.found = 0;
-
-	vfat_readdir(e, vfat_search_entry, &sd);
-	if (sd.found) {
-		next = strchr(path_v, ch);
-		if (next != 0) {
-			vfat_resolve(next, st, e);
-		}
-
-	}
-
-	return sd.found;
-
-	/* XXX add your code here */
-}
-
-// Get file attributes
-static int vfat_fuse_getattr(const char *path, struct stat *st) {
-	/* XXX: This is example code, replace with your own implementation */
-	DEBUG_PRINT("fuse getattr %s\n", path);
-	struct vfat_direntry e;
-	e.first_cluster = vfat_info.boot.fat32.root_cluster;
-	// No such file
-	if (strcmp(path, "/") == 0) {
-		st->st_dev = 0; // Ignored by FUSE
-		st->st_ino = 0; // Ignored by FUSE unless overridden
-		st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
-		st->st_nlink = 1;
-		st->st_uid = mount_uid;
-		st->st_gid = mount_gid;
-		st->st_rdev = 0;
-		st->st_size = 0;
-		st->st_blksize = 0; // Ignored by FUSE
-		st->st_blocks = 1;
-		return 0;
-	}  else {
-		vfat_resolve(path, st, &e);
-		return 0;
-	}
-//	{
-//		st->st_dev = 0; // Ignored by FUSE
-//		st->st_ino = 0; // Ignored by FUSE unless overridden
-//		st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFREG;
-//		st->st_nlink = 1;
-//		st->st_uid = mount_uid;
-//		st->st_gid = mount_gid;
-//		st->st_rdev = 0;
-//		st->st_size = 0;
-//		st->st_blksize = 0; // Ignored by FUSE
-//		st->st_blocks = 1;
-//		return 0;
-//	}
-
-	//return -ENOENT;
-}
-
-static int vfat_fuse_readdir(const char *path, void *buf,
-		fuse_fill_dir_t filler, off_t offs, struct fuse_file_info *fi) {
-	struct stat st;
-	struct vfat_direntry e;
-	int next = 0;
-	int res = 1;
-
-	/* XXX: This is example code, replace with your own implementation */
-	printf("fuse readdir %s\n", path);
-	printf("offset = %08X)\n", offs);
-	e.first_cluster = vfat_info.boot.fat32.root_cluster;
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	if (strcmp(path, "/")) {
-		res = vfat_resolve(path, &st, &e);
-
-	}
-	if (res)
-		vfat_readdir(&e, filler, buf);
-
-	//assert(offs == 0);
-	/* XXX add your code here */
-	//filler(buf, "a.txt", NULL, 0);
-	//filler(buf, "b.txt", NULL, 0);
-	return next;
-}
-
-static int vfat_fuse_read(const char *path, char *buf, size_t size, off_t offs,
-		struct fuse_file_info *fi) {
-	/* XXX: This is example code, replace with your own implementation */
-	DEBUG_PRINT("fuse read %s\n", path);
-	assert(size > 1);
-	buf[0] = 'X';
-	buf[1] = 'Y';
-
-	/* XXX add your code here */
-	return 2; // number of bytes read from the file
-	// must be size unless EOF reached, negative for an error
-}
-
-////////////// No need to modify anything below this point
-static int vfat_opt_args(void *data, const char *arg, int key,
-		struct fuse_args *oargs) {
-	if (key == FUSE_OPT_KEY_NONOPT && !vfat_info.dev) {
-		vfat_info.dev = strdup(arg);
-		return (0);
-	}
-	return (1);
-}
-
-static struct fuse_operations vfat_available_ops =
-		{ .getattr = vfat_fuse_getattr, .readdir = vfat_fuse_readdir, .read =
-				vfat_fuse_read, };
-
-int main(int argc, char **argv) {
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-
-	fuse_opt_parse(&args, NULL, NULL, vfat_opt_args);
-
-	if (!vfat_info.dev)
-		errx(1, "missing file system parameter");
-
-	vfat_init(vfat_info.dev);
-	return (fuse_main(args.argc, args.argv, &vfat_available_ops, NULL));
-}
+// vim: noet:ts=8:sts=8
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>  
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <osxfuse/fuse.h>
+#include <machine/endian.h>
+#else
+#include <fuse.h>
+#include <endian.h>
+#endif
+
+#include "vfat.h"
+
+struct vfat_direntry {
+	struct vfat_data *vol; // NULL for the root when several images are served
+	uint32_t first_cluster;
+};
+
+// What fi->fh points to for files of the volumes
+struct vfat_file {
+	struct vfat_data *vol;
+	uint32_t first_cluster;
+	uint32_t size;
+};
+
+uid_t mount_uid;
+gid_t mount_gid;
+time_t mount_time;
+
+// -o rw, the images are only opened for writing when asked to
+static int vfat_rw;
+
+/*
+ * State shared by all the volumes
+ */
+static void vfat_init(void) {
+	// These are useful so that we can setup correct permissions in the mounted directories
+	mount_uid = getuid();
+	mount_gid = getgid();
+
+	// Use mount time as mtime and ctime for the filesystem root entry (e.g. "/")
+	mount_time = time(NULL);
+	vfat_time_init();
+}
+
+/*
+ * Open an image, validate its boot sector and add it to the volumes.
+ * The FAT is read later, see vfat_start_loader().
+ */
+static void vfat_open_volume(const char *dev) {
+	struct vfat_data *vol = calloc(1, sizeof(*vol));
+	const char *name;
+	size_t i;
+	int res;
+
+	if (vol == NULL)
+		err(1, "calloc");
+
+	// The image is served as a directory named after the file
+	name = strrchr(dev, '/');
+	name = name ? name + 1 : dev;
+	if (*name == '\0' || strcmp(name, VFAT_STATS_NAME) == 0)
+		errx(1, "%s: can't be served as a directory", dev);
+	for (i = 0; i < vfat_nr_volumes; ++i) {
+		if (strcmp(vfat_volumes[i]->name, name) == 0)
+			errx(1, "%s and %s would have the same name", vfat_volumes[i]->dev,
+					dev);
+	}
+	vol->dev = dev;
+	vol->name = name;
+
+	// Nothing writes to the images yet, so don't take write access by default
+	vol->fs = open(dev, vfat_rw ? O_RDWR : O_RDONLY);
+	vol->readonly = !vfat_rw;
+	if (vol->fs < 0 && vfat_rw && (errno == EACCES || errno == EROFS)) {
+		vol->fs = open(dev, O_RDONLY);
+		vol->readonly = 1;
+		vlog(VLOG_WARN, "%s isn't writable, mounting read-only", dev);
+	}
+	if (vol->fs < 0)
+		err(1, "open(%s)", dev);
+	if ((res = vfat_backend_open(vol)) != 0)
+		errx(1, "%s: %s", dev, strerror(-res));
+	if (vol->backend.ops != &vfat_raw_backend)
+		vlog(VLOG_INFO, "%s: %s image%s", dev, vol->backend.ops->name,
+				vol->readonly ? ", mounting read-only" : "");
+
+	fat_open(vol);
+	wb_init(vol);
+	sparse_init(vol);
+	if (vfat_add_volume(vol) != 0)
+		errx(1, "%s: out of memory", dev);
+}
+
+/*
+ * Volume named by the first length bytes of name
+ */
+static struct vfat_data *vfat_find_volume(const char *name, size_t length) {
+	size_t i;
+
+	for (i = 0; i < vfat_nr_volumes; ++i) {
+		const char *n = vfat_volumes[i]->name;
+
+		if (strncmp(n, name, length) == 0 && n[length] == '\0')
+			return vfat_volumes[i];
+	}
+	return NULL;
+}
+
+/*
+ * Find the file/directory node given the path
+ * Components are looked up one after the other as (pointer, length) views of
+ * the path, so nothing is copied or allocated and the stack use doesn't depend
+ * on the depth of the path. When several images are served, the first
+ * component is the name of the volume.
+ */
+static int vfat_resolve(const char *path, struct stat *st,
+		struct vfat_direntry *e) {
+	const char *component = path;
+	struct vfat_dirent de;
+	size_t length;
+
+	vfat_fill_root_stat(st);
+	if (vfat_nr_volumes > 1) {
+		e->vol = NULL;
+		component += strspn(component, "/");
+		if (*component == '\0')
+			return 1;
+		length = strcspn(component, "/");
+		if ((e->vol = vfat_find_volume(component, length)) == NULL)
+			return 0;
+		component += length;
+	} else {
+		e->vol = vfat_volumes[0];
+	}
+	e->first_cluster = e->vol->boot.fat32.root_cluster;
+
+	for (;;) {
+		component += strspn(component, "/");
+		if (*component == '\0')
+			return 1;
+		length = strcspn(component, "/");
+
+		if (!S_ISDIR(st->st_mode))
+			return 0; // A file in the middle of the path
+		if (vfat_lookup(e->vol, e->first_cluster, component, length, &de) <= 0)
+			return 0;
+
+		vfat_fill_stat(&de.entry, st);
+		e->first_cluster = direntry_cluster(&de.entry);
+		component += length;
+	}
+}
+
+static inline int is_stats_file(const char *path) {
+	return path[0] == '/' && strcmp(path + 1, VFAT_STATS_NAME) == 0;
+}
+
+// Get file attributes
+static int vfat_fuse_getattr(const char *path, struct stat *st) {
+	uint64_t start = stats_op_begin();
+	struct vfat_direntry e;
+	int res = 0;
+
+	vlog(VLOG_TRACE, "%s", path);
+	if (is_stats_file(path))
+		stats_fill_stat(st);
+	else if (!vfat_resolve(path, st, &e))
+		res = -ENOENT;
+
+	stats_op_end(OP_GETATTR, start);
+	return res;
+}
+
+// Used by vfat_readdir_fill()
+struct vfat_readdir_data {
+	fuse_fill_dir_t filler;
+	void *buf;
+};
+
+static int vfat_readdir_fill(const struct vfat_dirent *de, void *data) {
+	struct vfat_readdir_data *rd = data;
+	struct stat st;
+
+	if (de->entry.nameext[0] == '.')
+		return 0; // "." and ".." are added by vfat_fuse_readdir()
+
+	vfat_fill_stat(&de->entry, &st);
+	return rd->filler(rd->buf, de->name, &st, 0) ? 1 : 0; // 1 when the buffer is full
+}
+
+static int vfat_fuse_readdir(const char *path, void *buf,
+		fuse_fill_dir_t filler, off_t offs, struct fuse_file_info *fi) {
+	struct vfat_readdir_data rd = { filler, buf };
+	uint64_t start = stats_op_begin();
+	struct vfat_direntry e;
+	struct stat st;
+	int res;
+
+	vlog(VLOG_TRACE, "%s", path);
+	if (!vfat_resolve(path, &st, &e)) {
+		res = -ENOENT;
+	} else if (!S_ISDIR(st.st_mode)) {
+		res = -ENOTDIR;
+	} else if (e.vol == NULL) {
+		// Root of the mount, one directory per volume
+		size_t i;
+
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		for (i = 0; i < vfat_nr_volumes; ++i) {
+			vfat_fill_root_stat(&st);
+			if (filler(buf, vfat_volumes[i]->name, &st, 0))
+				break;
+		}
+		res = 0;
+	} else {
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		res = vfat_iterate_dir(e.vol, e.first_cluster, vfat_readdir_fill, &rd);
+		if (res > 0)
+			res = 0;
+	}
+
+	stats_op_end(OP_READDIR, start);
+	return res;
+}
+
+static int vfat_fuse_open(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_op_begin();
+	struct vfat_direntry e;
+	struct stat st;
+	int res = 0;
+
+	if (is_stats_file(path)) {
+		// The content is fixed when the file is opened
+		struct stats_snapshot *snap = stats_snapshot();
+
+		if (snap == NULL) {
+			res = -ENOMEM;
+		} else {
+			fi->fh = (uintptr_t) snap;
+			fi->direct_io = 1;
+		}
+	} else if (!vfat_resolve(path, &st, &e)) {
+		res = -ENOENT;
+	} else if (S_ISDIR(st.st_mode)) {
+		res = -EISDIR;
+	} else {
+		struct vfat_file *file = malloc(sizeof(*file));
+
+		if (file == NULL) {
+			res = -ENOMEM;
+		} else {
+			file->vol = e.vol;
+			file->first_cluster = e.first_cluster;
+			file->size = st.st_size;
+			fi->fh = (uintptr_t) file;
+		}
+	}
+
+	stats_op_end(OP_OPEN, start);
+	return res;
+}
+
+static int vfat_stats_read(char *buf, size_t size, off_t offs,
+		struct fuse_file_info *fi) {
+	struct stats_snapshot *snap = (struct stats_snapshot*) (uintptr_t) fi->fh;
+
+	if (offs >= (off_t) snap->size)
+		return 0;
+	if (size > snap->size - offs)
+		size = snap->size - offs;
+	memcpy(buf, snap->data + offs, size);
+	return size;
+}
+
+static inline struct vfat_file *fh_file(struct fuse_file_info *fi) {
+	return (struct vfat_file*) (uintptr_t) fi->fh;
+}
+
+static int vfat_fuse_read(const char *path, char *buf, size_t size, off_t offs,
+		struct fuse_file_info *fi) {
+	uint64_t start = stats_op_begin();
+	struct vfat_file *file = fh_file(fi);
+	int res;
+
+	vlog(VLOG_TRACE, "%s: %zu bytes at %lld", path, size, (long long) offs);
+	if (is_stats_file(path))
+		res = vfat_stats_read(buf, size, offs, fi);
+	else
+		res = vfat_read_file(file->vol, file->first_cluster, buf,
+				vfat_clamp_read(file->size, size, offs), offs);
+
+	stats_op_end(OP_READ, start);
+	return res;
+}
+
+/*
+ * A bufvec with a single memory buffer of size bytes, for what can't be spliced
+ * from the device
+ */
+static struct fuse_bufvec *vfat_mem_bufvec(size_t size) {
+	struct fuse_bufvec *bufv = malloc(sizeof(*bufv));
+
+	if (bufv == NULL)
+		return NULL;
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].mem = malloc(size);
+	if (bufv->buf[0].mem == NULL) {
+		free(bufv);
+		return NULL;
+	}
+	return bufv;
+}
+
+static void vfat_free_bufvec(struct fuse_bufvec *bufv) {
+	free(bufv->buf[0].mem);
+	free(bufv);
+}
+
+/*
+ * Same as vfat_fuse_read() but the data isn't copied: the buffers returned point
+ * to the device, so that libfuse can splice() it directly to /dev/fuse.
+ */
+static int vfat_fuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+		size_t size, off_t offs, struct fuse_file_info *fi) {
+	struct vfat_file *file = fh_file(fi);
+	struct vfat_extent *extents;
+	struct fuse_bufvec *bufv;
+	int stats_file = is_stats_file(path);
+	uint64_t start;
+	int count, i, res;
+
+	if (!stats_file)
+		size = vfat_clamp_read(file->size, size, offs);
+
+	if (size > 0 && stats_file) {
+		bufv = vfat_mem_bufvec(size);
+		if (bufv == NULL)
+			return -ENOMEM;
+		res = vfat_fuse_read(path, bufv->buf[0].mem, size, offs, fi);
+		if (res < 0) {
+			vfat_free_bufvec(bufv);
+			return res;
+		}
+		bufv->buf[0].size = res;
+		*bufp = bufv;
+		return 0;
+	}
+
+	start = stats_op_begin();
+	count = 0;
+	extents = NULL;
+	if (size > 0) {
+		count = vfat_map_extents(file->vol, file->first_cluster, offs, size,
+				&extents);
+		if (count < 0) {
+			stats_op_end(OP_READ, start);
+			return count;
+		}
+	}
+
+	if (size > 0 && !vfat_can_splice(file->vol, extents, count)) {
+		bufv = vfat_mem_bufvec(size);
+		res = bufv ? vfat_read_extents(file->vol, extents, count,
+				bufv->buf[0].mem) : -ENOMEM;
+		free(extents);
+		stats_op_end(OP_READ, start);
+		if (res < 0) {
+			if (bufv)
+				vfat_free_bufvec(bufv);
+			return res;
+		}
+		bufv->buf[0].size = res;
+		*bufp = bufv;
+		return 0;
+	}
+
+	// struct fuse_bufvec already contains one buffer
+	bufv = malloc(sizeof(*bufv)
+			+ (count > 1 ? count - 1 : 0) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		free(extents);
+		stats_op_end(OP_READ, start);
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = count > 0 ? count : 1;
+
+	for (i = 0; i < count; ++i) {
+		bufv->buf[i].size = extents[i].len;
+		bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv->buf[i].mem = NULL;
+		bufv->buf[i].fd = file->vol->backend.fd;
+		bufv->buf[i].pos = extents[i].pos;
+	}
+
+	// libfuse reads the device, count it as if we did
+	stats_add(STAT_BYTES_READ, size);
+	stats_op_end(OP_READ, start);
+
+	free(extents);
+	*bufp = bufv;
+	return 0;
+}
+
+static int vfat_fuse_statfs(const char *path, struct statvfs *st) {
+	uint64_t start = stats_op_begin();
+	struct vfat_data *vol = vfat_volumes[0];
+	int res;
+
+	if (vfat_nr_volumes > 1) {
+		// The volume is the first component, the root gets the totals
+		path += strspn(path, "/");
+		vol = vfat_find_volume(path, strcspn(path, "/"));
+	}
+	res = vfat_fill_statfs(vol, st);
+
+	stats_op_end(OP_STATFS, start);
+	return res;
+}
+
+static void *vfat_fuse_init(struct fuse_conn_info *conn) {
+	// Let the kernel take the data of read_buf() straight from the device
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	// Threads have to be started here since fuse_main() forks to the background
+	vfat_log_start();
+	stats_start();
+	wb_start_timer();
+	vfat_start_loader();
+	return NULL;
+}
+
+static void vfat_fuse_destroy(void *private_data) {
+	vfat_stop_loader();
+	wb_destroy();
+	stats_stop();
+	vfat_log_stop();
+}
+
+static int vfat_fuse_flush(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_op_begin();
+	int res = is_stats_file(path) ? 0 : wb_flush(fh_file(fi)->vol);
+
+	stats_op_end(OP_FLUSH, start);
+	return res;
+}
+
+static int vfat_fuse_fsync(const char *path, int datasync,
+		struct fuse_file_info *fi) {
+	uint64_t start = stats_op_begin();
+	int res = is_stats_file(path) ? 0 : wb_flush(fh_file(fi)->vol);
+
+	stats_op_end(OP_FSYNC, start);
+	return res;
+}
+
+static int vfat_fuse_release(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_op_begin();
+	int res = is_stats_file(path) ? 0 : wb_flush(fh_file(fi)->vol);
+
+	free((void*) (uintptr_t) fi->fh); // The snapshot or the struct vfat_file
+
+	stats_op_end(OP_RELEASE, start);
+	return res;
+}
+
+////////////// No need to modify anything below this point
+enum {
+	KEY_LOWLEVEL,
+	KEY_LOGLEVEL,
+	KEY_RW,
+};
+
+static struct fuse_opt vfat_opts[] = {
+	FUSE_OPT_KEY("lowlevel", KEY_LOWLEVEL), // Serve requests with vfat_ll.c
+	FUSE_OPT_KEY("loglevel=", KEY_LOGLEVEL), // error, warn, info, debug or trace
+	FUSE_OPT_KEY("rw", KEY_RW), // Open the images read-write
+	FUSE_OPT_END
+};
+
+static int vfat_lowlevel;
+
+// Images, followed by the mount point
+static char **vfat_nonopts;
+static size_t vfat_nr_nonopts;
+
+static int vfat_opt_args(void *data, const char *arg, int key,
+		struct fuse_args *oargs) {
+	if (key == FUSE_OPT_KEY_NONOPT) {
+		char **grown = realloc(vfat_nonopts,
+				(vfat_nr_nonopts + 1) * sizeof(*grown));
+
+		if (grown == NULL || (grown[vfat_nr_nonopts] = strdup(arg)) == NULL)
+			err(1, "vfat_opt_args");
+		vfat_nonopts = grown;
+		++vfat_nr_nonopts;
+		return (0);
+	}
+	if (key == KEY_LOWLEVEL) {
+		vfat_lowlevel = 1;
+		return (0);
+	}
+	if (key == KEY_RW) {
+		vfat_rw = 1;
+		return (1); // Also passed to the kernel
+	}
+	if (key == KEY_LOGLEVEL) {
+		int level = vfat_log_parse_level(arg + strlen("loglevel="));
+
+		if (level < 0)
+			errx(1, "invalid log level in %s", arg);
+		if (level > VFAT_LOG_MAX)
+			warnx("%s: messages above level %d are compiled out", arg,
+					VFAT_LOG_MAX);
+		vfat_log_level = level;
+		return (0);
+	}
+	return (1);
+}
+
+static struct fuse_operations vfat_available_ops =
+		{ .getattr = vfat_fuse_getattr, .readdir = vfat_fuse_readdir, .read =
+				vfat_fuse_read, .read_buf = vfat_fuse_read_buf, .open =
+				vfat_fuse_open, .init = vfat_fuse_init, .destroy =
+				vfat_fuse_destroy, .flush = vfat_fuse_flush, .fsync =
+				vfat_fuse_fsync, .release = vfat_fuse_release, .statfs =
+				vfat_fuse_statfs, };
+
+/*
+ * usage: vfat [options] image... mountpoint
+ *
+ * With a single image, its root directory is the root of the mount. With
+ * several, each of them is a directory of the root named after the image file.
+ */
+int main(int argc, char **argv) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	size_t i;
+
+	fuse_opt_parse(&args, NULL, vfat_opts, vfat_opt_args);
+
+	if (vfat_nr_nonopts < 2)
+		errx(1, "missing file system parameter");
+
+	vfat_init();
+	for (i = 0; i + 1 < vfat_nr_nonopts; ++i)
+		vfat_open_volume(vfat_nonopts[i]);
+	fuse_opt_add_arg(&args, vfat_nonopts[vfat_nr_nonopts - 1]);
+
+	if (vfat_lowlevel)
+		return (vfat_ll_main(&args));
+	return (fuse_main(args.argc, args.argv, &vfat_available_ops, NULL));
+}
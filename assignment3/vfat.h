@@ -2,6 +2,8 @@
 #ifndef VFAT_H
 #define VFAT_H
 
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 struct fat_boot_fat32 {
@@ -85,4 +87,380 @@ struct fat32_direntry_long {
 #define VFAT_LFN_SEQ_MASK	0x3f
 #define VFAT_MAXFILE_NAME	255;
 
+struct vfat_wb;
+struct vfat_sparse;
+struct vfat_backend_ops;
+struct iovec;
+
+// How the bytes of a device are stored in the image file, see backend.c
+struct vfat_backend {
+	const struct vfat_backend_ops *ops;
+	int fd; // The image file
+	void *priv; // State of the backend
+};
+
+// A kitchen sink for all important data about a volume (one image)
+struct vfat_data {
+	const char *dev;
+	const char *name; // Directory of the volume when several images are served
+	size_t index; // In vfat_volumes
+	int fs; // The image file, only read through backend
+	struct vfat_backend backend;
+	int readonly; // Opened with O_RDONLY (no -o rw, or not writable), or its format can't be written
+	struct fat_boot boot;
+
+	size_t fat_begin; // offset of the FAT (in sectors)
+	size_t clusters_begin; // offset of the clusters (in sectors)
+	size_t fat_size; // size of FAT (in bytes)
+	size_t clusters_size; // size of a cluster (in bytes)
+	size_t clusters_count; // number of data clusters (the last one is #clusters_count + 1)
+
+	uint32_t* fat_content; // Only valid in the chunks marked in fat_loaded
+	uint8_t *fat_loaded; // Per chunk of FAT_CHUNK_SIZE bytes, set once it's read
+	size_t fat_chunks;
+	size_t fat_chunks_loaded;
+	pthread_mutex_t fat_lock; // Serializes the chunk loads
+	size_t free_clusters; // Counted as the chunks are loaded, then kept up to date by wb_set_fat()
+
+	struct vfat_wb *wb; // Write-back cache, see writeback.c
+	struct vfat_sparse *sparse; // Holes of the image, see sparse.c
+};
+
+extern uid_t mount_uid;
+extern gid_t mount_gid;
+extern time_t mount_time;
+
+/*
+ * Helper function to convert a number of sectors to a number of bytes
+ */
+static inline size_t sectors_to_bytes(const struct vfat_data *vol,
+		size_t number_of_sectors) {
+	return number_of_sectors * vol->boot.bytes_per_sector;
+}
+
+/*
+ * Helper function to convert a cluster number to a byte offset
+ */
+static inline size_t cluster_to_bytes(const struct vfat_data *vol,
+		size_t cluster_number) {
+	return vol->clusters_begin
+			+ (cluster_number - 2) * vol->clusters_size; // The first data cluster is cluster #2
+}
+
+#define FAT_ENTRY_MASK	0x0FFFFFFF // The 4 upper bits of a FAT entry are reserved
+#define FAT_ENTRY_BAD	0x0FFFFFF7
+#define FAT_ENTRY_EOC	0x0FFFFFF8 // Any value greater or equal means end of chain
+
+// First cluster of an entry, without the reserved upper bits
+static inline uint32_t direntry_cluster(const struct fat32_direntry *entry) {
+	return ((uint32_t) entry->cluster_hi << 16 | entry->cluster_lo)
+			& FAT_ENTRY_MASK;
+}
+
+/*
+ * Highest valid cluster number: it has to exist on the device and have an entry in the FAT
+ */
+static inline uint32_t fat_max_cluster(const struct vfat_data *vol) {
+	size_t fat_entries = vol->fat_size / sizeof(uint32_t);
+
+	if (vol->clusters_count + 1 < fat_entries)
+		return vol->clusters_count + 1;
+	return fat_entries - 1;
+}
+
+/*
+ * Block device backends (backend.c)
+ *
+ * All the I/O on a device goes through the backend picked for its image when
+ * it's opened: the raw backend for plain images, or the backend of a
+ * compressed format. Offsets and sizes are those of the uncompressed device.
+ * pread() and pwritev() have the semantics of the system calls.
+ */
+struct vfat_backend_ops {
+	const char *name;
+	int direct; // Device offsets are offsets in the image file, it can be spliced from
+	int (*probe)(int fd); // Whether the image is in this format
+	int (*open)(struct vfat_backend *be); // 0 or a negative errno value
+	ssize_t (*pread)(struct vfat_backend *be, void *buf, size_t len, off_t off);
+	ssize_t (*pwritev)(struct vfat_backend *be, const struct iovec *iov,
+			int iovcnt, off_t off); // NULL for read-only formats
+	int (*sync)(struct vfat_backend *be);
+};
+
+extern const struct vfat_backend_ops vfat_raw_backend;
+extern const struct vfat_backend_ops vfat_pack_backend;
+
+int vfat_backend_open(struct vfat_data *vol);
+
+static inline ssize_t vfat_dev_pread(struct vfat_data *vol, void *buf,
+		size_t len, off_t off) {
+	return vol->backend.ops->pread(&vol->backend, buf, len, off);
+}
+
+/*
+ * Compressed images (compressed.c, written by vfat_pack)
+ *
+ * The device is cut in chunks of chunk_size bytes compressed separately with
+ * zlib, so that any of them can be read on its own. The index gives the offset
+ * of every chunk in the file, followed by the end of the last one. A chunk of
+ * the same size as its uncompressed data is stored as is, an empty one only
+ * contains zeroes.
+ */
+#define VFAT_PACK_MAGIC "VFATPACK"
+#define VFAT_PACK_VERSION 1
+
+struct vfat_pack_header {
+	/* 0*/	char		magic[8];
+	/* 8*/	uint32_t	version;
+	/*12*/	uint32_t	chunk_size; // Power of 2
+	/*16*/	uint64_t	device_size;
+	/*24*/	uint64_t	nr_chunks;
+	/*32*/	uint64_t	index_offset; // nr_chunks + 1 uint64_t offsets
+} __attribute__ ((__packed__));
+
+/*
+ * The FAT is read in chunks, on demand or by the background loader (see
+ * vfat_start_loader()), so mounting doesn't have to wait for all of it
+ */
+#define FAT_CHUNK_SIZE (256 * 1024)
+#define FAT_CHUNK_ENTRIES (FAT_CHUNK_SIZE / sizeof(uint32_t))
+
+// fat.c
+void trim_filename(char* output, char* nameext);
+void check_boot_validity(const struct fat_boot* data);
+void fat_open(struct vfat_data *vol);
+int fat_load_chunk(struct vfat_data *vol, size_t chunk);
+int fat_load_all(struct vfat_data *vol);
+void fat_load(struct vfat_data *vol);
+
+static inline int fat_loaded_all(struct vfat_data *vol) {
+	return __atomic_load_n(&vol->fat_chunks_loaded, __ATOMIC_ACQUIRE)
+			== vol->fat_chunks;
+}
+
+/*
+ * Masked FAT entry of a cluster, reading its chunk first if needed. An
+ * unreadable entry is reported as a bad cluster, which ends any chain.
+ */
+static inline uint32_t fat_entry(struct vfat_data *vol, uint32_t cluster) {
+	size_t chunk = cluster / FAT_CHUNK_ENTRIES;
+
+	if (!__atomic_load_n(&vol->fat_loaded[chunk], __ATOMIC_ACQUIRE)
+			&& fat_load_chunk(vol, chunk) != 0)
+		return FAT_ENTRY_BAD;
+	return vol->fat_content[cluster] & FAT_ENTRY_MASK;
+}
+
+// fs.c
+struct stat;
+struct statvfs;
+
+// A run of contiguous clusters on the device
+struct vfat_extent {
+	off_t pos; // byte offset on the device
+	size_t len; // in bytes
+	uint32_t cluster; // first cluster of the run
+	int hole; // The run only contains zeroes, it doesn't have to be read
+};
+
+// A short directory entry, as seen by vfat_iterate_dir()
+struct vfat_dirent {
+	char name[12];
+	struct fat32_direntry entry;
+	off_t pos; // byte offset of the entry on the device
+};
+
+typedef int (*vfat_dir_cb)(const struct vfat_dirent *de, void *data);
+
+/*
+ * The first cluster and the size of an opened file are kept in the file handle
+ */
+static inline uint64_t vfat_fh(uint32_t first_cluster, uint32_t size) {
+	return (uint64_t) size << 32 | first_cluster;
+}
+
+static inline uint32_t fh_cluster(uint64_t fh) {
+	return fh & 0xFFFFFFFF;
+}
+
+static inline uint32_t fh_size(uint64_t fh) {
+	return fh >> 32;
+}
+
+/*
+ * Number of bytes that can be read at offs of a file of file_size bytes
+ */
+static inline size_t vfat_clamp_read(uint32_t file_size, size_t size, off_t offs) {
+	if (offs >= file_size)
+		return 0;
+	if (size > file_size - offs)
+		return file_size - offs;
+	return size;
+}
+
+// Volumes served by the process, in the order of the command line
+extern struct vfat_data **vfat_volumes;
+extern size_t vfat_nr_volumes;
+
+int vfat_add_volume(struct vfat_data *vol);
+int read_cluster(struct vfat_data *vol, void* buffer, size_t cluster_number);
+int vfat_read_direntry(struct vfat_data *vol, off_t pos,
+		struct fat32_direntry *entry);
+int vfat_iterate_dir(struct vfat_data *vol, uint32_t first_cluster,
+		vfat_dir_cb cb, void *data);
+int vfat_lookup(struct vfat_data *vol, uint32_t dir_cluster, const char *name,
+		size_t length, struct vfat_dirent *found);
+void vfat_dcache_invalidate(void);
+void vfat_start_loader(void);
+void vfat_stop_loader(void);
+void vfat_time_init(void);
+void vfat_fill_stat(const struct fat32_direntry *entry, struct stat *st);
+void vfat_fill_root_stat(struct stat *st);
+int vfat_fill_statfs(struct vfat_data *vol, struct statvfs *st);
+int vfat_map_extents(struct vfat_data *vol, uint32_t first_cluster, off_t offs,
+		size_t size, struct vfat_extent **extents);
+int vfat_can_splice(struct vfat_data *vol, const struct vfat_extent *extents,
+		int count);
+int vfat_read_extents(struct vfat_data *vol, const struct vfat_extent *extents,
+		int count, char *buf);
+int vfat_read_file(struct vfat_data *vol, uint32_t first_cluster, char *buf,
+		size_t size, off_t offs);
+
+
+// vfat_ll.c
+struct fuse_args;
+
+int vfat_ll_main(struct fuse_args *args);
+
+/*
+ * Logging (log.c)
+ *
+ * vlog() is filtered by the runtime level (-o loglevel=) and compiled out
+ * entirely above VFAT_LOG_MAX, so trace messages cost nothing unless the
+ * binary was built for them (make debug).
+ */
+enum vfat_log_level {
+	VLOG_ERROR,
+	VLOG_WARN,
+	VLOG_INFO,
+	VLOG_DEBUG,
+	VLOG_TRACE,
+};
+
+#ifndef VFAT_LOG_MAX
+#define VFAT_LOG_MAX VLOG_DEBUG
+#endif
+
+#define vlog(level, ...) do { \
+		if ((level) <= VFAT_LOG_MAX && (level) <= vfat_log_level) \
+			vfat_log((level), __func__, __VA_ARGS__); \
+	} while (0)
+
+extern int vfat_log_level;
+
+int vfat_log_parse_level(const char *s);
+void vfat_log(int level, const char *func, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+void vfat_log_start(void);
+void vfat_log_stop(void);
+
+/*
+ * Counters (stats.c), kept per thread and summed when they're read through
+ * /.vfat_stats or dumped on SIGUSR1
+ */
+#define VFAT_STATS_NAME ".vfat_stats"
+
+enum vfat_op {
+	OP_LOOKUP,
+	OP_FORGET,
+	OP_GETATTR,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_OPEN,
+	OP_READ,
+	OP_FLUSH,
+	OP_FSYNC,
+	OP_RELEASE,
+	OP_STATFS,
+	NR_OPS
+};
+
+enum vfat_stat {
+	STAT_DENTRY_HIT, // Name lookups (vfat_lookup())
+	STAT_DENTRY_MISS,
+	STAT_INODE_HIT, // Inode table of the low-level frontend
+	STAT_INODE_MISS,
+	STAT_WB_DIR_HIT, // Directory clusters looked up in the write-back cache
+	STAT_WB_DIR_MISS, // Only counted while something is dirty
+	STAT_WB_DATA_HIT, // Same for file data
+	STAT_WB_DATA_MISS,
+	STAT_BYTES_READ,
+	STAT_BYTES_WRITTEN,
+	STAT_SYSCALLS, // I/O system calls on the device
+	STAT_EXTENTS_MERGED, // Clusters appended to the previous extent
+	STAT_HOLE_BYTES, // Zero-filled instead of read, see sparse.c
+	NR_STATS
+};
+
+struct stats_snapshot {
+	size_t size;
+	char data[];
+};
+
+void stats_add(enum vfat_stat stat, uint64_t n);
+uint64_t stats_op_begin(void);
+void stats_op_end(enum vfat_op op, uint64_t start);
+struct stats_snapshot *stats_snapshot(void);
+void stats_fill_stat(struct stat *st);
+void stats_start(void);
+void stats_stop(void);
+
+// fatscan.c
+struct fat_scan {
+	size_t free; // Free clusters
+	size_t eoc; // End of chain markers, i.e. number of chains
+	size_t bad_links; // Links to clusters that don't exist
+};
+
+void fat_scan_range(const uint32_t *fat, uint32_t first, uint32_t last,
+		uint32_t max_cluster, struct fat_scan *res);
+void fat_scan(const uint32_t *fat, uint32_t max_cluster, struct fat_scan *res);
+
+/*
+ * Holes of sparse images (sparse.c)
+ */
+struct sparse_cursor {
+	off_t start, end; // Last region looked up, start with both at 0
+	int hole;
+};
+
+void sparse_init(struct vfat_data *vol);
+int sparse_is_hole(struct vfat_data *vol, struct sparse_cursor *cur, off_t pos,
+		size_t len);
+void sparse_scan(struct vfat_data *vol);
+void sparse_written(struct vfat_data *vol, off_t pos, size_t len);
+
+/*
+ * Write-back cache (writeback.c)
+ *
+ * Dirty clusters and FAT sectors are kept in memory and written out in
+ * batches, in the order data -> FAT -> directory entries.
+ */
+enum wb_kind {
+	WB_DATA,
+	WB_DIR,
+};
+
+void wb_init(struct vfat_data *vol);
+void wb_start_timer(void);
+void wb_destroy(void);
+int wb_write_cluster(struct vfat_data *vol, uint32_t cluster,
+		enum wb_kind kind, const void *buf, size_t offset, size_t len);
+int wb_read_range(struct vfat_data *vol, void *buffer, uint32_t cluster,
+		size_t offset, size_t len);
+int wb_read_cluster(struct vfat_data *vol, void *buffer, uint32_t cluster);
+int wb_has_dirty(struct vfat_data *vol);
+int wb_set_fat(struct vfat_data *vol, uint32_t cluster, uint32_t value);
+int wb_flush(struct vfat_data *vol);
+
 #endif
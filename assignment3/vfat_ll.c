@@ -0,0 +1,670 @@
+// vim: noet:ts=8:sts=8
+/*
+ * Low-level FUSE frontend, selected with -o lowlevel
+ *
+ * Requests come with inode numbers instead of paths, so nothing has to be
+ * resolved on the request path. The inode number of a file is the location
+ * of its directory entry on the device (in units of directory entries), so
+ * it's stable and can always be read back from the device. Entries the kernel
+ * knows about are kept in a table until it forgets them.
+ *
+ * When several images are served, the upper bits of an inode number hold the
+ * index of the volume plus one, so that FUSE_ROOT_ID stays the root of the
+ * mount, and the root directory of a volume is its FUSE_ROOT_ID.
+ */
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __APPLE__
+#include <osxfuse/fuse_lowlevel.h>
+#else
+#include <fuse_lowlevel.h>
+#endif
+
+#include "vfat.h"
+
+#define DIRECTORY_RECORD_SIZE 32
+#define INODE_HASH_SIZE 4096
+#define VFAT_LL_TIMEOUT 1.0 // seconds the kernel can cache entries and attributes
+#define VFAT_STATS_INO 2 // In the boot sector, so no directory entry has it
+#define INO_VOLUME_SHIFT 40 // Leaves room for 32 TiB images
+#define INO_LOCAL_MASK ((1ull << INO_VOLUME_SHIFT) - 1)
+
+// An inode the kernel holds a reference to
+struct vfat_inode {
+	fuse_ino_t ino;
+	uint64_t nlookup;
+	struct fat32_direntry entry;
+	struct vfat_inode *next; // Next inode in the same hash bucket
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct vfat_inode *hash[INODE_HASH_SIZE];
+} inodes = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Directory listing built by opendir, kept in fi->fh until releasedir
+struct vfat_ll_dirbuf {
+	fuse_req_t req;
+	struct vfat_data *vol;
+	char *p;
+	size_t size;
+	size_t capacity;
+};
+
+static inline fuse_ino_t volume_ino(const struct vfat_data *vol) {
+	if (vfat_nr_volumes == 1)
+		return 0;
+	return (fuse_ino_t) (vol->index + 1) << INO_VOLUME_SHIFT;
+}
+
+static inline fuse_ino_t pos_to_ino(const struct vfat_data *vol, off_t pos) {
+	return volume_ino(vol) | pos / DIRECTORY_RECORD_SIZE;
+}
+
+static inline off_t ino_to_pos(fuse_ino_t ino) {
+	return (off_t) (ino & INO_LOCAL_MASK) * DIRECTORY_RECORD_SIZE;
+}
+
+/*
+ * Volume of an inode, NULL for the root of the mount with several volumes
+ */
+static struct vfat_data *ino_volume(fuse_ino_t ino) {
+	fuse_ino_t index = ino >> INO_VOLUME_SHIFT;
+
+	if (vfat_nr_volumes == 1)
+		return vfat_volumes[0];
+	if (index == 0 || index > vfat_nr_volumes)
+		return NULL;
+	return vfat_volumes[index - 1];
+}
+
+// Root directory of a volume
+static inline int is_volume_root(fuse_ino_t ino) {
+	return (ino & INO_LOCAL_MASK) == FUSE_ROOT_ID;
+}
+
+/*
+ * Find an inode in the table. Must be called with the lock held.
+ */
+static struct vfat_inode *inode_find(fuse_ino_t ino) {
+	struct vfat_inode *inode;
+
+	for (inode = inodes.hash[ino % INODE_HASH_SIZE]; inode; inode =
+			inode->next) {
+		if (inode->ino == ino)
+			return inode;
+	}
+	return NULL;
+}
+
+/*
+ * Take a lookup reference on the inode, adding it to the table if needed
+ */
+static int inode_ref(fuse_ino_t ino, const struct fat32_direntry *entry) {
+	struct vfat_inode *inode;
+
+	pthread_mutex_lock(&inodes.lock);
+	inode = inode_find(ino);
+	if (inode == NULL) {
+		inode = malloc(sizeof(*inode));
+		if (inode == NULL) {
+			pthread_mutex_unlock(&inodes.lock);
+			return -ENOMEM;
+		}
+		inode->ino = ino;
+		inode->nlookup = 0;
+		inode->entry = *entry;
+		inode->next = inodes.hash[ino % INODE_HASH_SIZE];
+		inodes.hash[ino % INODE_HASH_SIZE] = inode;
+	}
+	++inode->nlookup;
+	pthread_mutex_unlock(&inodes.lock);
+
+	return 0;
+}
+
+static void inode_forget(fuse_ino_t ino, uint64_t nlookup) {
+	struct vfat_inode **link, *inode;
+
+	pthread_mutex_lock(&inodes.lock);
+	for (link = &inodes.hash[ino % INODE_HASH_SIZE]; (inode = *link); link =
+			&inode->next) {
+		if (inode->ino != ino)
+			continue;
+
+		if (inode->nlookup <= nlookup) {
+			*link = inode->next;
+			free(inode);
+		} else {
+			inode->nlookup -= nlookup;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&inodes.lock);
+}
+
+/*
+ * Directory entry of an inode other than a root
+ */
+static int inode_entry(struct vfat_data *vol, fuse_ino_t ino,
+		struct fat32_direntry *entry) {
+	struct vfat_inode *inode;
+
+	pthread_mutex_lock(&inodes.lock);
+	inode = inode_find(ino);
+	if (inode)
+		*entry = inode->entry;
+	pthread_mutex_unlock(&inodes.lock);
+
+	if (inode) {
+		stats_add(STAT_INODE_HIT, 1);
+		return 0;
+	}
+	stats_add(STAT_INODE_MISS, 1);
+
+	// Not referenced by the kernel anymore, the entry is still on the device
+	return vfat_read_direntry(vol, ino_to_pos(ino), entry);
+}
+
+/*
+ * Volume and first cluster of a directory inode, other than the root of the
+ * mount with several volumes
+ */
+static int inode_dir_cluster(fuse_ino_t ino, struct vfat_data **vol,
+		uint32_t *cluster) {
+	struct fat32_direntry entry;
+	int res;
+
+	if ((*vol = ino_volume(ino)) == NULL)
+		return -ENOENT;
+	if (is_volume_root(ino)) {
+		*cluster = (*vol)->boot.fat32.root_cluster;
+		return 0;
+	}
+
+	if ((res = inode_entry(*vol, ino, &entry)) != 0)
+		return res;
+	if (!(entry.attr & VFAT_ATTR_DIR))
+		return -ENOTDIR;
+
+	*cluster = direntry_cluster(&entry);
+	return 0;
+}
+
+static void vfat_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct vfat_dirent found;
+	struct fuse_entry_param e;
+	struct vfat_data *vol;
+	uint32_t cluster;
+	int res;
+
+	if (parent == FUSE_ROOT_ID && strcmp(name, VFAT_STATS_NAME) == 0) {
+		memset(&e, 0, sizeof(e));
+		e.ino = VFAT_STATS_INO;
+		stats_fill_stat(&e.attr);
+		e.attr.st_ino = e.ino;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	if (parent == FUSE_ROOT_ID && vfat_nr_volumes > 1) {
+		size_t i;
+
+		for (i = 0; i < vfat_nr_volumes; ++i) {
+			if (strcmp(vfat_volumes[i]->name, name) == 0)
+				break;
+		}
+		if (i == vfat_nr_volumes) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+
+		// Roots of volumes are never forgotten, no need to reference them
+		memset(&e, 0, sizeof(e));
+		e.ino = volume_ino(vfat_volumes[i]) | FUSE_ROOT_ID;
+		e.attr_timeout = VFAT_LL_TIMEOUT;
+		e.entry_timeout = VFAT_LL_TIMEOUT;
+		vfat_fill_root_stat(&e.attr);
+		e.attr.st_ino = e.ino;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	if ((res = inode_dir_cluster(parent, &vol, &cluster)) != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	res = vfat_lookup(vol, cluster, name, strlen(name), &found);
+	if (res <= 0) {
+		fuse_reply_err(req, res < 0 ? -res : ENOENT);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.ino = pos_to_ino(vol, found.pos);
+	e.attr_timeout = VFAT_LL_TIMEOUT;
+	e.entry_timeout = VFAT_LL_TIMEOUT;
+	vfat_fill_stat(&found.entry, &e.attr);
+	e.attr.st_ino = e.ino;
+
+	if ((res = inode_ref(e.ino, &found.entry)) != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+static void vfat_ll_forget(fuse_req_t req, fuse_ino_t ino,
+		unsigned long nlookup) {
+	inode_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void vfat_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	struct fat32_direntry entry;
+	struct stat st;
+	int res;
+
+	if (ino == FUSE_ROOT_ID || is_volume_root(ino)) {
+		vfat_fill_root_stat(&st);
+	} else if (ino == VFAT_STATS_INO) {
+		stats_fill_stat(&st);
+	} else if (ino_volume(ino) == NULL) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	} else {
+		if ((res = inode_entry(ino_volume(ino), ino, &entry)) != 0) {
+			fuse_reply_err(req, -res);
+			return;
+		}
+		vfat_fill_stat(&entry, &st);
+	}
+	st.st_ino = ino;
+
+	fuse_reply_attr(req, &st, VFAT_LL_TIMEOUT);
+}
+
+static int vfat_ll_dirbuf_add(struct vfat_ll_dirbuf *b, const char *name,
+		fuse_ino_t ino, mode_t mode) {
+	struct stat st;
+	size_t len = fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+
+	if (b->size + len > b->capacity) {
+		char *grown;
+		size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+
+		while (capacity < b->size + len)
+			capacity *= 2;
+		grown = realloc(b->p, capacity);
+		if (grown == NULL)
+			return -ENOMEM;
+		b->p = grown;
+		b->capacity = capacity;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = mode;
+	fuse_add_direntry(b->req, b->p + b->size, len, name, &st, b->size + len);
+	b->size += len;
+
+	return 0;
+}
+
+static int vfat_ll_dirbuf_fill(const struct vfat_dirent *de, void *data) {
+	struct vfat_ll_dirbuf *b = data;
+
+	if (de->entry.nameext[0] == '.')
+		return 0; // "." and ".." are added by opendir
+
+	return vfat_ll_dirbuf_add(b, de->name, pos_to_ino(b->vol, de->pos),
+			(de->entry.attr & VFAT_ATTR_DIR) ? S_IFDIR : S_IFREG);
+}
+
+/*
+ * Root of the mount with several volumes, one directory per volume
+ */
+static int vfat_ll_dirbuf_volumes(struct vfat_ll_dirbuf *b) {
+	size_t i;
+	int res = 0;
+
+	for (i = 0; i < vfat_nr_volumes && res == 0; ++i)
+		res = vfat_ll_dirbuf_add(b, vfat_volumes[i]->name,
+				volume_ino(vfat_volumes[i]) | FUSE_ROOT_ID, S_IFDIR);
+	return res;
+}
+
+static void vfat_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	struct vfat_data *vol = NULL;
+	struct vfat_ll_dirbuf *b;
+	uint32_t cluster = 0;
+	int res;
+
+	if ((ino != FUSE_ROOT_ID || vfat_nr_volumes == 1)
+			&& (res = inode_dir_cluster(ino, &vol, &cluster)) != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	b->req = req;
+	b->vol = vol;
+
+	res = vfat_ll_dirbuf_add(b, ".", ino, S_IFDIR);
+	if (res == 0)
+		res = vfat_ll_dirbuf_add(b, "..", FUSE_ROOT_ID, S_IFDIR);
+	if (res == 0 && vol == NULL)
+		res = vfat_ll_dirbuf_volumes(b);
+	else if (res == 0)
+		res = vfat_iterate_dir(vol, cluster, vfat_ll_dirbuf_fill, b);
+	if (res < 0) {
+		free(b->p);
+		free(b);
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	fi->fh = (uintptr_t) b;
+	fuse_reply_open(req, fi);
+}
+
+static void vfat_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi) {
+	struct vfat_ll_dirbuf *b = (struct vfat_ll_dirbuf*) (uintptr_t) fi->fh;
+
+	if (off >= (off_t) b->size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (size > b->size - off)
+		size = b->size - off;
+	fuse_reply_buf(req, b->p + off, size);
+}
+
+static void vfat_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	struct vfat_ll_dirbuf *b = (struct vfat_ll_dirbuf*) (uintptr_t) fi->fh;
+
+	free(b->p);
+	free(b);
+	fuse_reply_err(req, 0);
+}
+
+static void vfat_ll_open(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	struct fat32_direntry entry;
+	int res;
+
+	if (ino == FUSE_ROOT_ID || is_volume_root(ino)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if (ino == VFAT_STATS_INO) {
+		// The content is fixed when the file is opened
+		struct stats_snapshot *snap = stats_snapshot();
+
+		if (snap == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		fi->fh = (uintptr_t) snap;
+		fi->direct_io = 1;
+		fuse_reply_open(req, fi);
+		return;
+	}
+	if (ino_volume(ino) == NULL) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((res = inode_entry(ino_volume(ino), ino, &entry)) != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if (entry.attr & VFAT_ATTR_DIR) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	fi->fh = vfat_fh(direntry_cluster(&entry), entry.size);
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * Reply with buffers pointing to the device so that the data can be spliced
+ */
+static void vfat_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi) {
+	struct vfat_data *vol = ino_volume(ino);
+	struct vfat_extent *extents;
+	struct fuse_bufvec *bufv;
+	int count, i;
+
+	if (ino == VFAT_STATS_INO) {
+		struct stats_snapshot *snap = (struct stats_snapshot*) (uintptr_t) fi->fh;
+
+		if (off >= (off_t) snap->size)
+			size = 0;
+		else if (size > snap->size - off)
+			size = snap->size - off;
+		fuse_reply_buf(req, size ? snap->data + off : NULL, size);
+		return;
+	}
+
+	size = vfat_clamp_read(fh_size(fi->fh), size, off);
+	if (size == 0) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	count = vfat_map_extents(vol, fh_cluster(fi->fh), off, size, &extents);
+	if (count < 0) {
+		fuse_reply_err(req, -count);
+		return;
+	}
+
+	if (!vfat_can_splice(vol, extents, count)) {
+		char *buf = malloc(size);
+		int res = -ENOMEM;
+
+		if (buf)
+			res = vfat_read_extents(vol, extents, count, buf);
+		if (res < 0)
+			fuse_reply_err(req, -res);
+		else
+			fuse_reply_buf(req, buf, res);
+		free(buf);
+		free(extents);
+		return;
+	}
+
+	// struct fuse_bufvec already contains one buffer
+	bufv = malloc(sizeof(*bufv) + (count - 1) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		free(extents);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = count;
+	for (i = 0; i < count; ++i) {
+		bufv->buf[i].size = extents[i].len;
+		bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv->buf[i].mem = NULL;
+		bufv->buf[i].fd = vol->backend.fd;
+		bufv->buf[i].pos = extents[i].pos;
+	}
+
+	// libfuse reads the device, count it as if we did
+	stats_add(STAT_BYTES_READ, size);
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	free(bufv);
+	free(extents);
+}
+
+/*
+ * Write what's dirty on the volume of an opened file
+ */
+static int vfat_ll_flush_file(fuse_ino_t ino) {
+	if (ino == VFAT_STATS_INO)
+		return 0;
+	return wb_flush(ino_volume(ino));
+}
+
+static void vfat_ll_flush(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	fuse_reply_err(req, -vfat_ll_flush_file(ino));
+}
+
+static void vfat_ll_release(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	if (ino == VFAT_STATS_INO) {
+		free((void*) (uintptr_t) fi->fh);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	fuse_reply_err(req, -vfat_ll_flush_file(ino));
+}
+
+static void vfat_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi) {
+	fuse_reply_err(req, -vfat_ll_flush_file(ino));
+}
+
+static void vfat_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct statvfs st;
+	int res;
+
+	// The root of the mount with several volumes gets the totals
+	if ((res = vfat_fill_statfs(ino_volume(ino), &st)) != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_statfs(req, &st);
+}
+
+static void vfat_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	vfat_log_start();
+	stats_start();
+	wb_start_timer();
+	vfat_start_loader();
+}
+
+static void vfat_ll_destroy(void *userdata) {
+	vfat_stop_loader();
+	wb_destroy();
+	stats_stop();
+	vfat_log_stop();
+}
+
+/*
+ * Handlers reply before returning, so they're timed by wrappers
+ */
+#define VFAT_LL_TIMED(op, handler, params, args) \
+	static void handler##_timed params { \
+		uint64_t start = stats_op_begin(); \
+		handler args; \
+		stats_op_end(op, start); \
+	}
+
+VFAT_LL_TIMED(OP_LOOKUP, vfat_ll_lookup,
+		(fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+VFAT_LL_TIMED(OP_FORGET, vfat_ll_forget,
+		(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup),
+		(req, ino, nlookup))
+VFAT_LL_TIMED(OP_GETATTR, vfat_ll_getattr,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+VFAT_LL_TIMED(OP_OPEN, vfat_ll_open,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+VFAT_LL_TIMED(OP_READ, vfat_ll_read,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+				struct fuse_file_info *fi),
+		(req, ino, size, off, fi))
+VFAT_LL_TIMED(OP_FLUSH, vfat_ll_flush,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+VFAT_LL_TIMED(OP_RELEASE, vfat_ll_release,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+VFAT_LL_TIMED(OP_FSYNC, vfat_ll_fsync,
+		(fuse_req_t req, fuse_ino_t ino, int datasync,
+				struct fuse_file_info *fi),
+		(req, ino, datasync, fi))
+VFAT_LL_TIMED(OP_OPENDIR, vfat_ll_opendir,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+VFAT_LL_TIMED(OP_READDIR, vfat_ll_readdir,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+				struct fuse_file_info *fi),
+		(req, ino, size, off, fi))
+VFAT_LL_TIMED(OP_STATFS, vfat_ll_statfs, (fuse_req_t req, fuse_ino_t ino),
+		(req, ino))
+
+static struct fuse_lowlevel_ops vfat_ll_ops = {
+	.init = vfat_ll_init,
+	.destroy = vfat_ll_destroy,
+	.lookup = vfat_ll_lookup_timed,
+	.forget = vfat_ll_forget_timed,
+	.getattr = vfat_ll_getattr_timed,
+	.open = vfat_ll_open_timed,
+	.read = vfat_ll_read_timed,
+	.flush = vfat_ll_flush_timed,
+	.release = vfat_ll_release_timed,
+	.fsync = vfat_ll_fsync_timed,
+	.opendir = vfat_ll_opendir_timed,
+	.readdir = vfat_ll_readdir_timed,
+	.releasedir = vfat_ll_releasedir,
+	.statfs = vfat_ll_statfs_timed,
+};
+
+/*
+ * Equivalent of fuse_main() for the low-level API
+ */
+int vfat_ll_main(struct fuse_args *args) {
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int res = -1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+
+	ch = fuse_mount(mountpoint, args);
+	if (ch != NULL) {
+		se = fuse_lowlevel_new(args, &vfat_ll_ops, sizeof(vfat_ll_ops), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != -1) {
+					res = multithreaded ? fuse_session_loop_mt(se)
+							: fuse_session_loop(se);
+				}
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(args);
+
+	return res ? 1 : 0;
+}
@@ -0,0 +1,699 @@
+// vim: noet:ts=8:sts=8
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define WB_HASH_SIZE 1024
+#define WB_FLUSH_INTERVAL 5 // seconds between two background flushes
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// One dirty cluster (data or directory)
+struct wb_cluster {
+	uint32_t cluster;
+	enum wb_kind kind;
+	unsigned long seq; // Bumped by every write, see wb_write_dirs()
+	uint8_t *data;
+	struct wb_cluster *next; // Next entry in the same hash bucket
+};
+
+// Write-back state of one volume
+struct vfat_wb {
+	pthread_mutex_t flush_lock; // Serializes the flushes, taken before lock
+	pthread_mutex_t lock;
+
+	struct wb_cluster *hash[WB_HASH_SIZE];
+	size_t nr_dirty; // Number of dirty clusters (all kinds)
+	unsigned long inserts; // Bumped when a cluster enters the cache
+
+	uint8_t *fat_dirty; // One bit per sector of the FAT
+	size_t fat_sectors;
+	size_t nr_fat_dirty;
+};
+
+// The background flusher is shared by all the volumes
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Used to wake up the timer thread when unmounting
+	pthread_t thread;
+	int running;
+} timer = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static inline struct wb_cluster **wb_bucket(struct vfat_wb *wb,
+		uint32_t cluster) {
+	return &wb->hash[cluster % WB_HASH_SIZE];
+}
+
+/*
+ * Find the dirty entry of a cluster. Must be called with the lock held.
+ */
+static struct wb_cluster *wb_find(struct vfat_wb *wb, uint32_t cluster) {
+	struct wb_cluster *c;
+
+	for (c = *wb_bucket(wb, cluster); c; c = c->next) {
+		if (c->cluster == cluster)
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * pread() that retries on short reads
+ */
+static int wb_pread_full(struct vfat_data *vol, void *buffer, size_t size,
+		off_t offset) {
+	while (size > 0) {
+		ssize_t n = vfat_dev_pread(vol, buffer, size, offset);
+
+		stats_add(STAT_SYSCALLS, 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			return -EIO;
+		stats_add(STAT_BYTES_READ, n);
+		buffer = (uint8_t*) buffer + n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/*
+ * pwritev() the whole vector, resubmitting what is left after a short write.
+ * The iovec array is modified in place.
+ */
+static int wb_pwritev_full(struct vfat_data *vol, struct iovec *iov,
+		int iovcnt, off_t offset) {
+	while (iovcnt > 0) {
+		ssize_t n = vol->backend.ops->pwritev(&vol->backend, iov, iovcnt,
+				offset);
+
+		stats_add(STAT_SYSCALLS, 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		stats_add(STAT_BYTES_WRITTEN, n);
+		sparse_written(vol, offset, n);
+		offset += n;
+
+		// Skip what was written
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int wb_cluster_cmp(const void *a, const void *b) {
+	uint32_t ca = (*(struct wb_cluster * const *) a)->cluster;
+	uint32_t cb = (*(struct wb_cluster * const *) b)->cluster;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/*
+ * Array of the dirty clusters of the given kind, sorted by cluster number.
+ * Must be called with the lock held. Returns NULL if there's no memory.
+ */
+static struct wb_cluster **wb_collect(struct vfat_wb *wb, enum wb_kind kind,
+		size_t *count) {
+	struct wb_cluster **sorted;
+	size_t i;
+
+	sorted = malloc((wb->nr_dirty ? wb->nr_dirty : 1) * sizeof(*sorted));
+	if (sorted == NULL)
+		return NULL;
+
+	*count = 0;
+	for (i = 0; i < WB_HASH_SIZE; ++i) {
+		struct wb_cluster *c;
+		for (c = wb->hash[i]; c; c = c->next) {
+			if (c->kind == kind)
+				sorted[(*count)++] = c;
+		}
+	}
+	qsort(sorted, *count, sizeof(*sorted), wb_cluster_cmp);
+	return sorted;
+}
+
+/*
+ * Write sorted clusters. Adjacent clusters are merged into a single pwritev()
+ * call.
+ */
+static int wb_write_clusters(struct vfat_data *vol,
+		struct wb_cluster **sorted, size_t count) {
+	struct iovec iov[IOV_MAX];
+	size_t i, start;
+	int res = 0;
+
+	for (start = 0; start < count && res == 0; start = i) {
+		int iovcnt = 0;
+
+		// Extend the run as long as clusters are contiguous on disk
+		i = start;
+		do {
+			iov[iovcnt].iov_base = sorted[i]->data;
+			iov[iovcnt].iov_len = vol->clusters_size;
+			++iovcnt;
+			++i;
+		} while (i < count && iovcnt < IOV_MAX
+				&& sorted[i]->cluster == sorted[i - 1]->cluster + 1);
+
+		res = wb_pwritev_full(vol, iov, iovcnt,
+				cluster_to_bytes(vol, sorted[start]->cluster));
+	}
+	return res;
+}
+
+/*
+ * Take a dirty cluster out of the cache. Must be called with the lock held.
+ */
+static void wb_remove(struct vfat_wb *wb, struct wb_cluster *victim) {
+	struct wb_cluster **link;
+
+	for (link = wb_bucket(wb, victim->cluster); *link; link = &(*link)->next) {
+		if (*link == victim) {
+			*link = victim->next;
+			free(victim->data);
+			free(victim);
+			--wb->nr_dirty;
+			return;
+		}
+	}
+}
+
+/*
+ * Write the dirty data clusters and drop them, the device has their content
+ * once pwritev() returns. Must be called with the lock held.
+ */
+static int wb_flush_data(struct vfat_data *vol) {
+	struct vfat_wb *wb = vol->wb;
+	struct wb_cluster **sorted;
+	size_t count, i;
+	int res;
+
+	if ((sorted = wb_collect(wb, WB_DATA, &count)) == NULL)
+		return -ENOMEM;
+	res = wb_write_clusters(vol, sorted, count);
+	for (i = 0; i < count && res == 0; ++i)
+		wb_remove(wb, sorted[i]);
+	free(sorted);
+	return res;
+}
+
+/*
+ * Copy of the dirty FAT sectors, taken with the lock held so that it only
+ * references data that was written before it
+ */
+struct wb_fat_snapshot {
+	uint8_t *dirty; // One bit per sector, same as vfat_wb.fat_dirty
+	uint8_t *sectors; // The dirty sectors, packed in order
+};
+
+/*
+ * Move the dirty FAT sectors to snap. Must be called with the lock held.
+ */
+static int wb_snapshot_fat(struct vfat_data *vol, struct wb_fat_snapshot *snap) {
+	struct vfat_wb *wb = vol->wb;
+	size_t sector_size = vol->boot.bytes_per_sector;
+	size_t sector, packed = 0;
+
+	snap->dirty = malloc((wb->fat_sectors + 7) / 8);
+	snap->sectors = malloc(wb->nr_fat_dirty * sector_size);
+	if (snap->dirty == NULL || snap->sectors == NULL) {
+		free(snap->dirty);
+		free(snap->sectors);
+		return -ENOMEM;
+	}
+
+	memcpy(snap->dirty, wb->fat_dirty, (wb->fat_sectors + 7) / 8);
+	for (sector = 0; sector < wb->fat_sectors; ++sector) {
+		if (wb->fat_dirty[sector / 8] & (1 << (sector % 8)))
+			memcpy(snap->sectors + packed++ * sector_size,
+					(uint8_t*) vol->fat_content
+							+ sector * sector_size, sector_size);
+	}
+	memset(wb->fat_dirty, 0, (wb->fat_sectors + 7) / 8);
+	wb->nr_fat_dirty = 0;
+	return 0;
+}
+
+/*
+ * Mark the sectors of a snapshot that couldn't be written dirty again.
+ * Must be called with the lock held.
+ */
+static void wb_restore_fat(struct vfat_wb *wb, struct wb_fat_snapshot *snap) {
+	size_t sector;
+
+	for (sector = 0; sector < wb->fat_sectors; ++sector) {
+		if ((snap->dirty[sector / 8] & (1 << (sector % 8)))
+				&& !(wb->fat_dirty[sector / 8] & (1 << (sector % 8)))) {
+			wb->fat_dirty[sector / 8] |= 1 << (sector % 8);
+			++wb->nr_fat_dirty;
+		}
+	}
+}
+
+/*
+ * Write a FAT snapshot to every copy of the FAT
+ */
+static int wb_flush_fat(struct vfat_data *vol, struct wb_fat_snapshot *snap) {
+	size_t fat_sectors = vol->wb->fat_sectors;
+	size_t sector_size = vol->boot.bytes_per_sector;
+	size_t copy, start, end, packed = 0;
+	int res = 0;
+
+	for (start = 0; start < fat_sectors && res == 0; start = end) {
+		struct iovec iov;
+
+		if (!(snap->dirty[start / 8] & (1 << (start % 8)))) {
+			end = start + 1;
+			continue;
+		}
+
+		// Dirty sectors are packed, so a run of them is one write
+		end = start + 1;
+		while (end < fat_sectors
+				&& (snap->dirty[end / 8] & (1 << (end % 8))))
+			++end;
+
+		for (copy = 0; copy < vol->boot.fat_count && res == 0; ++copy) {
+			iov.iov_base = snap->sectors + packed * sector_size;
+			iov.iov_len = (end - start) * sector_size;
+			res = wb_pwritev_full(vol, &iov, 1,
+					vol->fat_begin + copy * vol->fat_size
+							+ start * sector_size);
+		}
+		packed += end - start;
+	}
+
+	return res;
+}
+
+// Copy of the dirty directory clusters, see wb_snapshot_dirs()
+struct wb_dir_snapshot {
+	struct wb_cluster *copies;
+	struct wb_cluster **sorted; // Points to copies, in cluster order
+	size_t count;
+};
+
+static void wb_free_dirs(struct wb_dir_snapshot *snap) {
+	size_t i;
+
+	for (i = 0; snap->copies != NULL && i < snap->count; ++i)
+		free(snap->copies[i].data);
+	free(snap->copies);
+	free(snap->sorted);
+}
+
+/*
+ * Copy the dirty directory clusters to snap. They stay in the cache, so that
+ * readers don't see the stale device content until they're written.
+ * Must be called with the lock held.
+ */
+static int wb_snapshot_dirs(struct vfat_data *vol, struct wb_dir_snapshot *snap) {
+	struct vfat_wb *wb = vol->wb;
+	size_t i;
+
+	snap->copies = NULL;
+	snap->count = 0;
+	if ((snap->sorted = wb_collect(wb, WB_DIR, &snap->count)) == NULL)
+		return -ENOMEM;
+	snap->copies = calloc(snap->count ? snap->count : 1, sizeof(*snap->copies));
+	if (snap->copies == NULL)
+		goto nomem;
+
+	for (i = 0; i < snap->count; ++i) {
+		struct wb_cluster *c = snap->sorted[i];
+
+		snap->copies[i] = *c;
+		if ((snap->copies[i].data = malloc(vol->clusters_size)) == NULL)
+			goto nomem;
+		memcpy(snap->copies[i].data, c->data, vol->clusters_size);
+		snap->sorted[i] = &snap->copies[i];
+	}
+	return 0;
+
+nomem:
+	wb_free_dirs(snap);
+	return -ENOMEM;
+}
+
+/*
+ * Write a directory snapshot, then drop the clusters from the cache unless
+ * they were modified in the meantime
+ */
+static int wb_write_dirs(struct vfat_data *vol, struct wb_dir_snapshot *snap) {
+	struct vfat_wb *wb = vol->wb;
+	size_t i;
+	int res;
+
+	if ((res = wb_write_clusters(vol, snap->sorted, snap->count)) != 0)
+		return res;
+
+	pthread_mutex_lock(&wb->lock);
+	for (i = 0; i < snap->count; ++i) {
+		struct wb_cluster *c = wb_find(wb, snap->copies[i].cluster);
+
+		if (c != NULL && c->seq == snap->copies[i].seq)
+			wb_remove(wb, c);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return 0;
+}
+
+static void wb_drop_clusters(struct vfat_wb *wb) {
+	size_t i;
+
+	for (i = 0; i < WB_HASH_SIZE; ++i) {
+		struct wb_cluster *c, *next;
+		for (c = wb->hash[i]; c; c = next) {
+			next = c->next;
+			free(c->data);
+			free(c);
+		}
+		wb->hash[i] = NULL;
+	}
+	wb->nr_dirty = 0;
+}
+
+static int wb_sync(struct vfat_data *vol) {
+	stats_add(STAT_SYSCALLS, 1);
+	return vol->backend.ops->sync ? vol->backend.ops->sync(&vol->backend) : 0;
+}
+
+/*
+ * Background flusher, wakes up every WB_FLUSH_INTERVAL seconds
+ */
+static void *wb_timer_main(void *arg) {
+	pthread_mutex_lock(&timer.lock);
+	while (timer.running) {
+		struct timespec deadline;
+		size_t i;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += WB_FLUSH_INTERVAL;
+		pthread_cond_timedwait(&timer.cond, &timer.lock, &deadline);
+
+		for (i = 0; i < vfat_nr_volumes; ++i) {
+			int res = wb_flush(vfat_volumes[i]);
+
+			if (res != 0)
+				vlog(VLOG_ERROR, "%s: background flush failed: %s",
+						vfat_volumes[i]->dev, strerror(-res));
+		}
+	}
+	pthread_mutex_unlock(&timer.lock);
+	return NULL;
+}
+
+/*
+ * Allocate the write-back state of the volume. Has to be called once the boot
+ * sector has been read.
+ */
+void wb_init(struct vfat_data *vol) {
+	struct vfat_wb *wb = calloc(1, sizeof(*wb));
+
+	if (wb == NULL)
+		goto nomem;
+	pthread_mutex_init(&wb->flush_lock, NULL);
+	pthread_mutex_init(&wb->lock, NULL);
+	wb->fat_sectors = vol->fat_size / vol->boot.bytes_per_sector;
+	wb->fat_dirty = calloc((wb->fat_sectors + 7) / 8, 1);
+	if (wb->fat_dirty == NULL)
+		goto nomem;
+
+	vol->wb = wb;
+	return;
+
+nomem:
+	errno = ENOMEM;
+	err(1, "wb_init");
+}
+
+/*
+ * Start the background flusher. Has to be called from the FUSE init callback
+ * since fuse_main() forks when going to the background.
+ */
+void wb_start_timer(void) {
+	pthread_mutex_lock(&timer.lock);
+	timer.running = 1;
+	if (pthread_create(&timer.thread, NULL, wb_timer_main, NULL) != 0)
+		timer.running = 0;
+	pthread_mutex_unlock(&timer.lock);
+}
+
+/*
+ * Stop the flusher and write everything that is still dirty, on every volume
+ */
+void wb_destroy(void) {
+	int running;
+	size_t i;
+
+	pthread_mutex_lock(&timer.lock);
+	running = timer.running;
+	timer.running = 0;
+	pthread_cond_signal(&timer.cond);
+	pthread_mutex_unlock(&timer.lock);
+
+	if (running)
+		pthread_join(timer.thread, NULL);
+
+	for (i = 0; i < vfat_nr_volumes; ++i) {
+		struct vfat_data *vol = vfat_volumes[i];
+
+		wb_flush(vol);
+		wb_drop_clusters(vol->wb);
+		free(vol->wb->fat_dirty);
+		pthread_mutex_destroy(&vol->wb->lock);
+		pthread_mutex_destroy(&vol->wb->flush_lock);
+		free(vol->wb);
+		vol->wb = NULL;
+	}
+}
+
+/*
+ * Copy len bytes at offset in the cached copy of the cluster and mark it dirty.
+ * The cluster is read from the device the first time it's dirtied.
+ */
+int wb_write_cluster(struct vfat_data *vol, uint32_t cluster,
+		enum wb_kind kind, const void *buf, size_t offset, size_t len) {
+	struct vfat_wb *wb = vol->wb;
+	struct wb_cluster *c, *fresh = NULL;
+	int res;
+
+	if (vol->readonly)
+		return -EROFS;
+	if (offset + len > vol->clusters_size)
+		return -EINVAL;
+
+	pthread_mutex_lock(&wb->lock);
+	while ((c = wb_find(wb, cluster)) == NULL) {
+		unsigned long inserts = wb->inserts;
+
+		/*
+		 * Partial writes need the rest of the cluster. It's read without the
+		 * lock, so that readers of other dirty clusters don't wait for it.
+		 */
+		pthread_mutex_unlock(&wb->lock);
+		if (fresh == NULL) {
+			fresh = calloc(1, sizeof(*fresh));
+			if (fresh == NULL
+					|| (fresh->data = malloc(vol->clusters_size)) == NULL) {
+				free(fresh);
+				return -ENOMEM;
+			}
+		}
+		if (len < vol->clusters_size) {
+			res = wb_pread_full(vol, fresh->data, vol->clusters_size,
+					cluster_to_bytes(vol, cluster));
+			if (res != 0) {
+				free(fresh->data);
+				free(fresh);
+				return res;
+			}
+		}
+		pthread_mutex_lock(&wb->lock);
+
+		/*
+		 * Another writer may have cached the cluster meanwhile, or even
+		 * flushed it while it was being read: read it again then.
+		 */
+		if (wb->inserts != inserts)
+			continue;
+
+		c = fresh;
+		fresh = NULL;
+		c->cluster = cluster;
+		c->kind = kind;
+		c->next = *wb_bucket(wb, cluster);
+		*wb_bucket(wb, cluster) = c;
+		++wb->nr_dirty;
+		++wb->inserts;
+		break;
+	}
+
+	memcpy(c->data + offset, buf, len);
+	++c->seq;
+	if (kind == WB_DIR)
+		vfat_dcache_invalidate();
+	pthread_mutex_unlock(&wb->lock);
+
+	if (fresh != NULL) {
+		free(fresh->data);
+		free(fresh);
+	}
+	return 0;
+}
+
+/*
+ * Copy len bytes at offset of the dirty version of the cluster to buffer.
+ * Returns 1 if the cluster was in the cache, 0 otherwise.
+ */
+int wb_read_range(struct vfat_data *vol, void *buffer, uint32_t cluster,
+		size_t offset, size_t len) {
+	struct vfat_wb *wb = vol->wb;
+	struct wb_cluster *c;
+	int found = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->nr_dirty > 0 && (c = wb_find(wb, cluster)) != NULL) {
+		memcpy(buffer, c->data + offset, len);
+		found = 1;
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return found;
+}
+
+/*
+ * Copy the dirty version of the cluster to buffer.
+ * Returns 1 if the cluster was in the cache, 0 otherwise.
+ */
+int wb_read_cluster(struct vfat_data *vol, void *buffer, uint32_t cluster) {
+	return wb_read_range(vol, buffer, cluster, 0, vol->clusters_size);
+}
+
+/*
+ * Whether any cluster is dirty. Lets readers skip the cache lookups.
+ */
+int wb_has_dirty(struct vfat_data *vol) {
+	return __atomic_load_n(&vol->wb->nr_dirty, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * Update an entry of the in-memory FAT and mark its sector dirty.
+ * The 4 upper bits of the entry are reserved and kept as they are.
+ */
+int wb_set_fat(struct vfat_data *vol, uint32_t cluster, uint32_t value) {
+	struct vfat_wb *wb = vol->wb;
+	uint32_t old;
+	size_t sector;
+	int res;
+
+	if (vol->readonly)
+		return -EROFS;
+	if (cluster < 2 || cluster > fat_max_cluster(vol))
+		return -EINVAL;
+	if ((res = fat_load_chunk(vol, cluster / FAT_CHUNK_ENTRIES)) != 0)
+		return res;
+
+	pthread_mutex_lock(&wb->lock);
+	old = vol->fat_content[cluster] & FAT_ENTRY_MASK;
+	vol->fat_content[cluster] = (vol->fat_content[cluster]
+			& ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+
+	// Keep the statfs() numbers exact without scanning the FAT again
+	if (old == 0 && (value & FAT_ENTRY_MASK) != 0)
+		__atomic_sub_fetch(&vol->free_clusters, 1, __ATOMIC_RELAXED);
+	else if (old != 0 && (value & FAT_ENTRY_MASK) == 0)
+		__atomic_add_fetch(&vol->free_clusters, 1, __ATOMIC_RELAXED);
+
+	sector = cluster * sizeof(uint32_t) / vol->boot.bytes_per_sector;
+	if (!(wb->fat_dirty[sector / 8] & (1 << (sector % 8)))) {
+		wb->fat_dirty[sector / 8] |= 1 << (sector % 8);
+		++wb->nr_fat_dirty;
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return 0;
+}
+
+/*
+ * Write all dirty data to the device, respecting the FAT32 ordering rules: the
+ * data has to be on disk before the FAT points to it, and the FAT has to be on
+ * disk before a directory entry references the chain.
+ *
+ * The lock is only held while the data clusters are written and the dirty FAT
+ * sectors and directory clusters are copied, all in one critical section, never
+ * across the fdatasync() calls, so that readers of dirty clusters don't wait for
+ * the disk. The FAT and the directories are written from these copies: a FAT
+ * entry or a directory entry changed in the meantime can't reference data that
+ * isn't on disk yet, it waits for the next flush.
+ * Returns 0 on success or a negative errno value.
+ */
+int wb_flush(struct vfat_data *vol) {
+	struct vfat_wb *wb = vol->wb;
+	struct wb_fat_snapshot snap = { NULL, NULL };
+	struct wb_dir_snapshot dirs = { NULL, NULL, 0 };
+	int res, fat_dirty;
+
+	pthread_mutex_lock(&wb->flush_lock);
+	pthread_mutex_lock(&wb->lock);
+	if (wb->nr_dirty == 0 && wb->nr_fat_dirty == 0) {
+		pthread_mutex_unlock(&wb->lock);
+		pthread_mutex_unlock(&wb->flush_lock);
+		return 0;
+	}
+
+	res = wb_flush_data(vol);
+	fat_dirty = wb->nr_fat_dirty > 0;
+	if (res == 0 && fat_dirty)
+		res = wb_snapshot_fat(vol, &snap);
+	if (res == 0)
+		res = wb_snapshot_dirs(vol, &dirs);
+	pthread_mutex_unlock(&wb->lock);
+
+	if (res == 0)
+		res = wb_sync(vol);
+
+	if (res == 0 && fat_dirty && (res = wb_flush_fat(vol, &snap)) == 0)
+		res = wb_sync(vol);
+	if (res != 0 && snap.dirty != NULL) {
+		pthread_mutex_lock(&wb->lock);
+		wb_restore_fat(wb, &snap);
+		pthread_mutex_unlock(&wb->lock);
+	}
+	free(snap.dirty);
+	free(snap.sectors);
+
+	if (res == 0 && (res = wb_write_dirs(vol, &dirs)) == 0)
+		res = wb_sync(vol);
+	wb_free_dirs(&dirs);
+
+	pthread_mutex_unlock(&wb->flush_lock);
+	return res;
+}